@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "llama.cpp/include/llama.h"
+
+#include "hash.hpp"
+#include "tokencache.hpp"
+
+// cache of the token spans of rendered chat messages. a span is keyed by the chained hash of the
+// messages up to and including its last one, and covers n_msgs messages counted back from
+// there, so that a conversation prefix is the chain of spans walked back to its first message.
+// a span keeps the text of its messages, and every span of the walk is checked against it.
+class chat_cache {
+
+  private:
+    token_lru spans;
+
+    static uint64_t mix(uint64_t h, const std::string &s) {
+        h = fnv1a(h, s.data(), s.size());
+        // the length delimits the fields
+        for (size_t n = s.size(), i = 0; i < sizeof(n); i++, n >>= 8) {
+            h = fnv1a(h, uint8_t(n));
+        }
+        return h;
+    }
+
+  public:
+    void init(size_t n_tokens) {
+        spans.init(n_tokens);
+    }
+
+    bool enabled() const {
+        return spans.enabled();
+    }
+
+    // the hash of an empty conversation, FNV-1a mixed with the flag
+    static uint64_t seed(bool add_special) {
+        return fnv1a(FNV1A_SEED, uint8_t(add_special ? 1 : 0));
+    }
+
+    // the hash of the conversation extended by a message
+    static uint64_t chain(uint64_t h, const std::string &role, const std::string &content) {
+        return mix(mix(h, role), content);
+    }
+
+    // the text of a message, the lengths delimit the fields
+    static std::string text(const std::string &role, const std::string &content) {
+        return std::to_string(role.size()) + ":" + role + std::to_string(content.size()) + ":" +
+               content;
+    }
+
+    // the text a span of messages is checked against, from the texts of the messages, with
+    // where the span begins and the flag since the first messages render differently
+    static std::string text(const std::vector<std::string> &texts, size_t begin, size_t end,
+                            bool add_special) {
+        std::string ret = std::to_string(begin) + (add_special ? "+" : "-");
+        for (size_t i = begin; i < end; i++) {
+            ret += texts[i];
+        }
+        return ret;
+    }
+
+    // the number of messages covered by the span of the key, which ends at message end,
+    // 0 if not cached or the span does not hold these messages
+    int32_t find(uint64_t key, const std::vector<std::string> &texts, size_t end,
+                 bool add_special) {
+        const int32_t n = spans.tag(key);
+        if (n <= 0 || size_t(n) > end) {
+            return 0;
+        }
+        return spans.find(key, text(texts, end - n, end, add_special)) == n ? n : 0;
+    }
+
+    // append the tokens of the span of the key and text to out, returns false on a miss
+    bool get(uint64_t key, const std::string &text, std::vector<llama_token> &out) {
+        return spans.get(key, text, out);
+    }
+
+    void put(uint64_t key, const std::string &text, int32_t n_msgs,
+             const std::vector<llama_token> &tokens) {
+        spans.put(key, text, n_msgs, tokens);
+    }
+};
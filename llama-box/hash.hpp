@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// 64-bit FNV-1a, computed incrementally so that a hash can be chained over several fields.
+// it is cheap but trivially collidable, a hit must be checked against what was hashed.
+
+static const uint64_t FNV1A_SEED = 0xcbf29ce484222325ull;
+
+static inline uint64_t fnv1a(uint64_t h, uint8_t b) {
+    h ^= b;
+    h *= 0x100000001b3ull;
+    return h;
+}
+
+static inline uint64_t fnv1a(uint64_t h, const void *data, size_t n) {
+    const auto *p = static_cast<const uint8_t *>(data);
+    for (size_t i = 0; i < n; i++) {
+        h = fnv1a(h, p[i]);
+    }
+    return h;
+}
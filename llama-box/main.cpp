@@ -2,9 +2,15 @@
 #include <chrono>
 #include <condition_variable>
 #include <csignal>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <thread>
+#include <unordered_map>
 
 #include "llama.cpp/common/common.h"
 #include "llama.cpp/common/json-schema-to-grammar.h"
@@ -20,19 +26,21 @@
 #include "llama.cpp/examples/llava/llava.h"
 #include "llama.cpp/examples/server/httplib.h"
 
+#include "chatcache.hpp"
 #include "param.hpp"
+#include "piecetable.hpp"
+#include "radixtree.hpp"
 #include "ratelimiter.hpp"
+#include "ringbuffer.hpp"
+#include "snapshot.hpp"
+#include "stopmatcher.hpp"
+#include "tokencache.hpp"
 #include "utils.hpp"
 
 using json = nlohmann::json;
 
 bool server_log_json = true;
 
-enum stop_type {
-    STOP_TYPE_FULL,
-    STOP_TYPE_PARTIAL,
-};
-
 enum slot_state {
     SLOT_STATE_IDLE,
     SLOT_STATE_PROCESSING,
@@ -54,12 +62,73 @@ enum server_state {
 enum server_task_type {
     SERVER_TASK_TYPE_COMPLETION,
     SERVER_TASK_TYPE_CANCEL,
-    SERVER_TASK_TYPE_NEXT_RESPONSE,
     SERVER_TASK_TYPE_METRICS,
     SERVER_TASK_TYPE_SLOT_SAVE,
     SERVER_TASK_TYPE_SLOT_RESTORE,
     SERVER_TASK_TYPE_SLOT_ERASE,
     SERVER_TASK_TYPE_SET_LORA,
+    SERVER_TASK_TYPE_PREFIX_ADD,
+    SERVER_TASK_TYPE_PREFIX_LIST,
+    SERVER_TASK_TYPE_PREFIX_DELETE,
+    SERVER_TASK_TYPE_SLOT_FINISH,
+    SERVER_TASK_TYPE_PREFIX_READ,
+};
+
+enum server_sched_policy {
+    SERVER_SCHED_POLICY_FCFS,     // first come, first served
+    SERVER_SCHED_POLICY_SJF,      // shortest job first
+    SERVER_SCHED_POLICY_PRIORITY, // higher priority first
+};
+
+// the state of a slot staged between the main loop and the I/O thread,
+// the data covers the tokens before the deltas
+struct server_slot_snapshot {
+    std::vector<llama_token> tokens;
+    std::vector<uint8_t> data;
+    std::vector<slot_snapshot_delta> deltas;
+};
+
+// what a slot save file holds, so that the next save only appends a delta
+struct server_slot_save_record {
+    std::vector<llama_token> tokens;
+    int32_t n_deltas = 0;
+};
+
+// an admitted request counted as waiting for a slot until the task is dropped, i.e. processed
+// by the main loop, since a deferred task is moved, not dropped
+struct server_admission {
+    std::atomic<int32_t> *n_waiting = nullptr;
+    int32_t n_ahead = 0; // requests waiting when admitted
+
+    server_admission() = default;
+    explicit server_admission(std::atomic<int32_t> &n)
+        : n_waiting(&n), n_ahead(n.fetch_add(1)) {
+    }
+    server_admission(server_admission &&other) noexcept
+        : n_waiting(other.n_waiting), n_ahead(other.n_ahead) {
+        other.n_waiting = nullptr;
+    }
+    server_admission &operator=(server_admission &&other) noexcept {
+        if (this != &other) {
+            release();
+            n_waiting = other.n_waiting;
+            n_ahead = other.n_ahead;
+            other.n_waiting = nullptr;
+        }
+        return *this;
+    }
+    server_admission(const server_admission &) = delete;
+    server_admission &operator=(const server_admission &) = delete;
+    ~server_admission() {
+        release();
+    }
+
+    void release() {
+        if (n_waiting != nullptr) {
+            n_waiting->fetch_sub(1);
+            n_waiting = nullptr;
+        }
+    }
 };
 
 struct server_task {
@@ -74,6 +143,24 @@ struct server_task {
     bool embedding = false;
 
     int tps = 0;
+    int priority = 0;
+    int32_t n_cost = -1; // estimated tokens of the task, filled when deferring under sjf
+    int64_t t_deferred = -1; // when the task was first deferred, in us
+
+    std::shared_ptr<server_slot_snapshot> snapshot; // staged state of slot restore
+
+    // prompt of a completion task tokenized by the HTTP thread
+    bool tokenized = false;
+    std::vector<llama_token> prompt_tokens;
+
+    server_admission admission;
+
+    // tasks are moved through the queue, never copied
+    server_task() = default;
+    server_task(server_task &&) = default;
+    server_task &operator=(server_task &&) = default;
+    server_task(const server_task &) = delete;
+    server_task &operator=(const server_task &) = delete;
 };
 
 struct server_task_result {
@@ -108,6 +195,12 @@ struct slot_params {
     json input_suffix;
 };
 
+// an alternative to a draft token, verified along with the drafts
+struct server_draft_branch {
+    int32_t depth; // of the draft token it replaces
+    llama_token tok;
+};
+
 struct server_slot {
     int id;
     int id_task = -1;
@@ -180,10 +273,55 @@ struct server_slot {
 
     token_bucket *token_bkt = nullptr; // bucket for tokens per second
 
+    // preemption
+    int priority = 0;
+    bool swapped = false; // the sequence is swapped out to host memory
+    int64_t t_swapped = 0;
+    std::vector<uint8_t> swap_data;
+    std::vector<uint8_t> swap_data_draft;
+
+    // the named prefix to prompt with
+    std::vector<llama_token> prefix_tokens;
+    // the evicted named prefix the slot prefills with its prompt, taken back once decoded
+    std::string named_prefix_pending;
+
+    // stop words compiled over the generated bytes and over the generated token ids
+    stop_matcher<char> stop_text;
+    stop_matcher<llama_token> stop_tokens;
+
+    // the slot is done generating, waiting for the deferred text work before the final response
+    bool finishing = false;
+
+    // prompt tokenized ahead of time while the pipelined decode runs
+    bool prompt_staged = false;
+    std::vector<llama_token> prompt_tokens_staged;
+
+    // hash of the spilled prefix the slot waits to be read ahead from disk, 0 if none
+    uint64_t prefix_pending = 0;
+
     /* speculative decoding */
     int32_t n_drafted = 0;
     int32_t n_drafted_accepted = 0;
+    int32_t n_decode_steps = 0; // target decodes that sampled tokens
     std::vector<llama_token> sampled_draft;
+    // verify the drafts by speculative sampling instead of matching the target sample,
+    // needs the target probabilities, i.e. no greedy, mirostat or grammar sampling
+    bool draft_stochastic = false;
+    // the distributions the drafts are sampled from, sorted by id,
+    // the n-gram drafts have none, i.e. a draft token has probability 1
+    std::vector<std::vector<llama_token_data>> sampled_draft_probs;
+    // alternatives to the drafts by ascending depth, one at most per draft token, each on a
+    // sequence of its own holding the cells of the slot and the drafts before it
+    std::vector<server_draft_branch> draft_branches;
+    int32_t n_draft = 0;           // tokens to draft next, 0 = speculation paused
+    int32_t n_draft_paused = 0;    // rounds since speculation paused or last probed
+    float draft_accepted_ewma = 0; // acceptance rate of a draft token
+    std::vector<uint64_t> draft_accepted_hist; // verified rounds by accepted drafts
+    // tokens missing from the draft KV cache, e.g. the last draft of a round, from position
+    // draft_tail_pos, the draft KV cache holds the positions before n_past_draft, -1 = unknown
+    std::vector<llama_token> draft_tail;
+    llama_pos draft_tail_pos = 0;
+    llama_pos n_past_draft = -1;
     // draft-model speculative decoding
     llama_sampling_context *ctx_sampling_draft = nullptr;
     // model-free speculative decoding
@@ -220,7 +358,17 @@ struct server_slot {
 
         n_drafted = 0;
         n_drafted_accepted = 0;
+        n_decode_steps = 0;
         sampled_draft.clear();
+        draft_stochastic = false;
+        sampled_draft_probs.clear();
+        n_draft = 0;
+        n_draft_paused = 0;
+        draft_accepted_ewma = 0;
+        draft_accepted_hist.clear();
+        draft_tail.clear();
+        draft_tail_pos = 0;
+        n_past_draft = -1;
 
         if (ctx_sampling_draft != nullptr) {
             llama_sampling_free(ctx_sampling_draft);
@@ -228,6 +376,21 @@ struct server_slot {
         }
 
         lookup_ngram_min = 0;
+
+        swapped = false;
+        swap_data.clear();
+        swap_data.shrink_to_fit();
+        swap_data_draft.clear();
+        swap_data_draft.shrink_to_fit();
+
+        prefix_tokens.clear();
+        named_prefix_pending.clear();
+
+        finishing = false;
+
+        prompt_staged = false;
+        prompt_tokens_staged.clear();
+        prefix_pending = 0;
     }
 
     bool has_budget(gpt_params &global_params) {
@@ -255,13 +418,6 @@ struct server_slot {
                state == SLOT_STATE_PROCESSING;
     }
 
-    void add_token_string(const completion_token_output &token) {
-        if (command == SLOT_COMMAND_RELEASE) {
-            return;
-        }
-        generated_token_probs.push_back(token);
-    }
-
     void release() {
         if (state == SLOT_STATE_PROCESSING) {
             t_token_generation = double(ggml_time_us() - t_start_generation) / 1e3;
@@ -289,38 +445,201 @@ struct server_slot {
             ret["drafted_n"] = n_drafted;
             ret["drafted_accepted_n"] = n_drafted_accepted;
             ret["drafted_accepted_p"] = float(n_drafted_accepted) / float(n_drafted);
+            ret["drafted_tokens_per_step"] = float(n_decoded) / float(std::max(n_decode_steps, 1));
         }
 
         return ret;
     }
 
-    size_t find_stopping_strings(const std::string &text, const size_t last_token_size,
-                                 const stop_type type) {
-        size_t stop_pos = std::string::npos;
+    // count a verified round of n drafts, n_accepted of them accepted
+    void on_draft_verified(int32_t n, int32_t n_accepted) {
+        if (draft_accepted_hist.size() <= size_t(n_accepted)) {
+            draft_accepted_hist.resize(n_accepted + 1, 0);
+        }
+        draft_accepted_hist[n_accepted] += 1;
+
+        // each draft is a trial, up to the first rejected one
+        const float w = 0.1f;
+        for (int32_t j = 0; j < n_accepted; j++) {
+            draft_accepted_ewma += w * (1.0f - draft_accepted_ewma);
+        }
+        if (n_accepted < n) {
+            draft_accepted_ewma -= w * draft_accepted_ewma;
+        }
+    }
 
-        for (const std::string &word : params.antiprompt) {
-            size_t pos;
+    // keep the tokens of a round ending at pos the draft KV cache does not hold
+    void push_draft_tail(const std::vector<llama_token> &toks, llama_pos pos) {
+        const llama_pos pos_first = pos - llama_pos(toks.size()) + 1;
+        if (n_past_draft < 0 || n_past_draft > pos) {
+            n_past_draft = pos;
+        }
+        if (draft_tail.empty() || draft_tail_pos + llama_pos(draft_tail.size()) != pos_first) {
+            draft_tail.clear();
+            draft_tail_pos = pos_first;
+        }
+        draft_tail.insert(draft_tail.end(), toks.begin(), toks.end());
+
+        // the held ones, and the oldest ones if the tail cannot be caught up with
+        const llama_pos n_held = std::min(n_past_draft - draft_tail_pos,
+                                          llama_pos(draft_tail.size()) - 1);
+        const llama_pos n_drop = std::max(n_held, llama_pos(draft_tail.size()) - 256);
+        if (n_drop > 0) {
+            draft_tail.erase(draft_tail.begin(), draft_tail.begin() + n_drop);
+            draft_tail_pos += n_drop;
+        }
+    }
 
-            if (type == STOP_TYPE_FULL) {
-                const size_t tmp = word.size() + last_token_size;
-                const size_t from_pos = text.size() > tmp ? text.size() - tmp : 0;
+    // keep the distribution the last draft token is sampled from
+    void push_draft_probs(const llama_sampling_context *ctx_draft_sampling) {
+        sampled_draft_probs.emplace_back(ctx_draft_sampling->cur.begin(),
+                                         ctx_draft_sampling->cur.begin() +
+                                             long(ctx_draft_sampling->n_valid));
+        std::sort(sampled_draft_probs.back().begin(), sampled_draft_probs.back().end(),
+                  [](const llama_token_data &a, const llama_token_data &b) { return a.id < b.id; });
+    }
 
-                pos = text.find(word, from_pos);
-            } else {
-                pos = find_partial_stop_string(word, text);
+    // branch off the last draft token with the most likely other candidate it is sampled from,
+    // if at least a quarter as likely, returns false if not or there are n_branches already
+    bool push_draft_branch(const llama_sampling_context *ctx_draft_sampling, int32_t n_branches) {
+        if (int32_t(draft_branches.size()) >= n_branches) {
+            return false;
+        }
+        const llama_token x = sampled_draft.back();
+        const std::vector<llama_token_data> &cur = ctx_draft_sampling->cur;
+        // greedy sampling leaves the candidates as they are, the others keep the valid ones first
+        const size_t n_cur =
+            ctx_draft_sampling->n_valid > 0 ? ctx_draft_sampling->n_valid : cur.size();
+        float logit_x = -INFINITY;
+        const llama_token_data *alt = nullptr;
+        for (size_t k = 0; k < n_cur; k++) {
+            if (cur[k].id == x) {
+                logit_x = cur[k].logit;
+            } else if (alt == nullptr || cur[k].logit > alt->logit) {
+                alt = &cur[k];
             }
+        }
+        if (alt == nullptr || alt->logit < logit_x - std::log(4.0f)) {
+            return false;
+        }
+        draft_branches.push_back({int32_t(sampled_draft.size()) - 1, alt->id});
+        return true;
+    }
+
+    // branch off each n-gram draft token with the most frequent other continuation of the
+    // longest context n-gram it follows, if at least a quarter as frequent, up to n_branches
+    int32_t push_ngram_branches(int32_t n_branches) {
+        const auto n_inp = int32_t(prompt_tokens.size());
+        const auto at = [&](int32_t t) {
+            return t < n_inp ? prompt_tokens[t] : sampled_draft[t - n_inp];
+        };
 
-            if (pos != std::string::npos && (stop_pos == std::string::npos || pos < stop_pos)) {
-                if (type == STOP_TYPE_FULL) {
-                    stopped_word = true;
-                    stopping_word = word;
-                    has_next_token = false;
+        int32_t n_pushed = 0;
+        for (int32_t j = 0; j < int32_t(sampled_draft.size()) &&
+                            int32_t(draft_branches.size()) < n_branches;
+             j++) {
+            for (int32_t ngram_size = LLAMA_NGRAM_MAX; ngram_size >= lookup_ngram_min;
+                 ngram_size--) {
+                if (ngram_size > n_inp + j) {
+                    continue;
+                }
+                llama_ngram ngram;
+                for (int32_t k = 0; k < ngram_size; k++) {
+                    ngram.tokens[k] = at(n_inp + j - ngram_size + k);
+                }
+                const auto part = ctx_ngram_cache.find(ngram);
+                if (part == ctx_ngram_cache.end()) {
+                    continue;
+                }
+                int32_t count_x = 0;
+                llama_token alt = -1;
+                int32_t count_alt = 0;
+                for (const auto &tc : part->second) {
+                    if (tc.first == sampled_draft[j]) {
+                        count_x = tc.second;
+                    } else if (tc.second > count_alt) {
+                        alt = tc.first;
+                        count_alt = tc.second;
+                    }
+                }
+                if (alt >= 0 && 4 * count_alt >= count_x) {
+                    draft_branches.push_back({j, alt});
+                    n_pushed++;
                 }
-                stop_pos = pos;
+                break;
+            }
+        }
+        return n_pushed;
+    }
+
+    // the alternative to the j-th draft token the target sample tok is, -1 if none
+    int32_t find_draft_branch(int32_t j, llama_token tok) const {
+        for (size_t b = 0; b < draft_branches.size(); b++) {
+            if (draft_branches[b].depth == j && draft_branches[b].tok == tok) {
+                return int32_t(b);
+            }
+        }
+        return -1;
+    }
+
+    // speculative sampling of the j-th draft token x, accept it with probability
+    // min(1, p(x) / q(x)), otherwise sample tok from the residual max(0, p - q) normalized,
+    // where p is the target distribution sampled last and q the draft one,
+    // so that the tokens follow p whatever the drafts are
+    bool accept_draft(size_t j, llama_token &tok) {
+        static const std::vector<llama_token_data> none;
+        const llama_token x = sampled_draft[j];
+        const std::vector<llama_token_data> &q =
+            j < sampled_draft_probs.size() ? sampled_draft_probs[j] : none;
+        const auto prob_q = [&q, x](llama_token id) {
+            if (q.empty()) {
+                return id == x ? 1.0f : 0.0f;
+            }
+            const auto it = std::lower_bound(
+                q.begin(), q.end(), id,
+                [](const llama_token_data &d, llama_token v) { return d.id < v; });
+            return it != q.end() && it->id == id ? it->p : 0.0f;
+        };
+
+        const llama_token_data *p = ctx_sampling->cur.data();
+        const size_t n_p = ctx_sampling->n_valid;
+        float p_x = 0.0f;
+        for (size_t k = 0; k < n_p; k++) {
+            if (p[k].id == x) {
+                p_x = p[k].p;
+                break;
             }
         }
+        const float q_x = prob_q(x);
+
+        std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+        if (q_x > 0.0f && uniform(ctx_sampling->rng) * q_x < p_x) {
+            tok = x;
+            return true;
+        }
 
-        return stop_pos;
+        std::vector<float> residual(n_p);
+        float sum = 0.0f;
+        for (size_t k = 0; k < n_p; k++) {
+            residual[k] = std::max(0.0f, p[k].p - prob_q(p[k].id));
+            sum += residual[k];
+        }
+        // p and q only differ by rounding, keep the target sample
+        if (sum <= 0.0f) {
+            return false;
+        }
+        float r = uniform(ctx_sampling->rng) * sum;
+        for (size_t k = 0; k < n_p; k++) {
+            if (residual[k] <= 0.0f) {
+                continue;
+            }
+            tok = p[k].id;
+            r -= residual[k];
+            if (r < 0.0f) {
+                break;
+            }
+        }
+        return false;
     }
 
     void push_token_into_result(llama_token tok, completion_token_output &result,
@@ -383,6 +702,9 @@ struct server_metrics {
     uint64_t n_tokens_drafted = 0;
     uint64_t n_tokens_drafted_accepted = 0;
 
+    // verified rounds by accepted drafts, per slot
+    std::vector<std::vector<uint64_t>> drafted_accepted_hist;
+
     void init() {
         t_start = ggml_time_us();
     }
@@ -403,6 +725,19 @@ struct server_metrics {
         n_tokens_drafted_total += slot.n_drafted;
         n_tokens_drafted_accepted += slot.n_drafted_accepted;
         n_tokens_drafted_accepted_total += slot.n_drafted_accepted;
+
+        if (!slot.draft_accepted_hist.empty()) {
+            if (drafted_accepted_hist.size() <= size_t(slot.id)) {
+                drafted_accepted_hist.resize(slot.id + 1);
+            }
+            std::vector<uint64_t> &hist = drafted_accepted_hist[slot.id];
+            if (hist.size() < slot.draft_accepted_hist.size()) {
+                hist.resize(slot.draft_accepted_hist.size(), 0);
+            }
+            for (size_t a = 0; a < slot.draft_accepted_hist.size(); a++) {
+                hist[a] += slot.draft_accepted_hist[a];
+            }
+        }
     }
 
     void reset_bucket() {
@@ -415,16 +750,377 @@ struct server_metrics {
     }
 };
 
-struct server_queue {
-    int id = 0;
-    bool running;
+// load of the server, written by the main loop and read by the HTTP threads
+// to decide whether a new request can be admitted
+struct server_load {
+    std::atomic<int32_t> n_slots{0};
+    std::atomic<int32_t> n_idle_slots{0};
+    std::atomic<int32_t> n_waiting_tasks{0}; // admitted, not processed by the main loop yet
+    std::atomic<int64_t> n_pending_prompt_tokens{0};
+
+    // exponentially weighted moving averages of the finished requests
+    std::atomic<double> prefill_tps{0.0}; // prompt tokens per second
+    std::atomic<double> decode_tps{0.0};  // generated tokens per second of one slot
+    std::atomic<double> n_decoded{0.0};   // generated tokens of one request
+
+    void on_prompt_eval(const server_slot &slot) {
+        if (slot.n_prompt_tokens_processed <= 0 || slot.t_prompt_processing <= 0) {
+            return;
+        }
+        ewma(prefill_tps, 1e3 * slot.n_prompt_tokens_processed / slot.t_prompt_processing);
+    }
+
+    void on_prediction(const server_slot &slot) {
+        if (slot.n_decoded <= 0 || slot.t_token_generation <= 0) {
+            return;
+        }
+        ewma(decode_tps, 1e3 * slot.n_decoded / slot.t_token_generation);
+        ewma(n_decoded, slot.n_decoded);
+    }
+
+    // estimate the milliseconds waiting for an available slot
+    int64_t estimate_slot_wait() const {
+        const int32_t n_ahead = n_waiting_tasks.load() - n_idle_slots.load();
+        const double tps = decode_tps.load();
+        if (n_ahead < 0 || tps <= 0) {
+            return 0;
+        }
+        const int32_t n_waves = n_ahead / std::max(1, n_slots.load()) + 1;
+        return int64_t(1e3 * n_waves * n_decoded.load() / tps);
+    }
+
+    // estimate the milliseconds to the first token of a new request,
+    // i.e. waiting for an available slot plus prefilling all pending prompts
+    int64_t estimate_ttft(int32_t n_prompt_tokens) const {
+        const double tps = prefill_tps.load();
+        if (tps <= 0) {
+            return 0;
+        }
+        return estimate_slot_wait() +
+               int64_t(1e3 * double(n_pending_prompt_tokens.load() + n_prompt_tokens) / tps);
+    }
+
+  private:
+    static void ewma(std::atomic<double> &avg, double v) {
+        const double prev = avg.load();
+        avg.store(prev <= 0 ? v : 0.8 * prev + 0.2 * v);
+    }
+};
+
+// the KV state of a prefix handed to the I/O thread, kept in memory until it is written
+struct server_prefix_spill {
+    std::vector<llama_token> tokens;
+    std::vector<uint8_t> data;
+    std::atomic<int> state{0}; // 0 = writing, 1 = written, -1 = failed
+};
+
+// host-side tiers of the prefix cache, the KV state of a sequence is kept in RAM first and
+// spilled to disk when RAM runs out, both are indexed by the hash of the tokens it holds
+struct server_prefix_entry {
+    std::vector<llama_token> tokens;
+    std::vector<uint8_t> data; // empty if on disk
+    std::string path;          // empty if in RAM
+    size_t size = 0;
+    int64_t t_last_used = 0;
+    std::shared_ptr<server_prefix_spill> spill; // set while being written to disk
+    bool reading = false;                       // being read ahead from disk
+};
+
+struct server_prefix_store {
+    size_t ram_budget = 0;  // bytes, 0 disables the RAM tier
+    size_t disk_budget = 0; // bytes, 0 disables the disk tier
+    std::string disk_path;  // directory with a trailing separator
+
+    size_t ram_used = 0;
+    size_t disk_used = 0;
+    std::unordered_map<uint64_t, server_prefix_entry> ram;
+    std::unordered_map<uint64_t, server_prefix_entry> disk;
+    // token length -> entries of the length in any tier,
+    // so that a lookup only checks the lengths that exist
+    std::map<size_t, int32_t> lengths;
+    // disk entries read ahead that do not fit in RAM, taken by the next get
+    std::unordered_map<uint64_t, std::vector<uint8_t>> loaded;
+
+    // runs the file I/O of the disk tier in order off the main loop, inline if unset
+    std::function<void(std::function<void()>)> post_io;
+
+    ~server_prefix_store() {
+        for (const auto &it : disk) {
+            std::remove(it.second.path.c_str());
+        }
+    }
+
+    bool enabled() const {
+        return ram_budget > 0 || disk_budget > 0;
+    }
+
+    bool contains(uint64_t hash) const {
+        return get_entry(hash) != nullptr;
+    }
+
+    // store the KV state of the tokens, returns false if it fits in no tier
+    bool put(const std::vector<llama_token> &tokens, std::vector<uint8_t> &&data) {
+        const uint64_t hash = snapshot_hash(tokens);
+        if (contains(hash)) {
+            return true;
+        }
+        server_prefix_entry entry;
+        entry.tokens = tokens;
+        entry.size = data.size();
+        entry.data = std::move(data);
+        entry.t_last_used = ggml_time_us();
+        lengths[tokens.size()]++;
+        if (entry.size <= ram_budget) {
+            put_ram(hash, std::move(entry));
+            return true;
+        }
+        if (!put_disk(hash, std::move(entry))) {
+            forget(tokens.size());
+            return false;
+        }
+        return true;
+    }
+
+    // find the longest stored prefix of the tokens, returns {hash, length} or {0, 0}
+    std::pair<uint64_t, size_t> find(const std::vector<llama_token> &tokens) const {
+        std::pair<uint64_t, size_t> ret = {0, 0};
+        uint64_t hash = snapshot_hash_init();
+        auto it = lengths.begin();
+        for (size_t i = 0; i < tokens.size() && it != lengths.end(); i++) {
+            hash = snapshot_hash_step(hash, tokens[i]);
+            if (it->first != i + 1) {
+                continue;
+            }
+            it++;
+            const server_prefix_entry *entry = get_entry(hash);
+            if (entry != nullptr &&
+                std::equal(entry->tokens.begin(), entry->tokens.end(), tokens.begin())) {
+                ret = {hash, i + 1};
+            }
+        }
+        return ret;
+    }
+
+    // load the KV state of the entry if it is in memory, returns false if it is on disk only,
+    // see read_ahead
+    bool get(uint64_t hash, std::vector<uint8_t> &data) {
+        auto it = ram.find(hash);
+        if (it != ram.end()) {
+            it->second.t_last_used = ggml_time_us();
+            data = it->second.data;
+            return true;
+        }
+        it = disk.find(hash);
+        if (it == disk.end()) {
+            return false;
+        }
+        auto lt = loaded.find(hash);
+        if (lt != loaded.end()) {
+            it->second.t_last_used = ggml_time_us();
+            data = std::move(lt->second);
+            loaded.erase(lt);
+            return true;
+        }
+        if (it->second.spill != nullptr) {
+            // still being written
+            it->second.t_last_used = ggml_time_us();
+            data = it->second.spill->data;
+            return true;
+        }
+        return false;
+    }
+
+    // read the entry from disk on the I/O thread, done is called there with the state read,
+    // or an empty one on failure, returns false if the entry is not on disk
+    bool read_ahead(uint64_t hash,
+                    std::function<void(std::shared_ptr<server_slot_snapshot>)> done) {
+        auto it = disk.find(hash);
+        if (it == disk.end()) {
+            return false;
+        }
+        if (it->second.reading) {
+            return true;
+        }
+        it->second.reading = true;
+        const std::string path = it->second.path;
+        run_io([path, done]() {
+            std::shared_ptr<server_slot_snapshot> snapshot(new server_slot_snapshot);
+            if (!snapshot_read(path, snapshot->tokens, snapshot->data)) {
+                snapshot->tokens.clear();
+                snapshot->data.clear();
+            }
+            done(snapshot);
+        });
+        return true;
+    }
+
+    // take the state read ahead, the entry is promoted to RAM if it fits
+    void on_read(uint64_t hash, server_slot_snapshot &snapshot) {
+        auto it = disk.find(hash);
+        if (it == disk.end()) {
+            return;
+        }
+        it->second.reading = false;
+        if (snapshot.data.empty() || snapshot.tokens != it->second.tokens) {
+            drop_disk(it);
+            return;
+        }
+        it->second.t_last_used = ggml_time_us();
+        if (it->second.size > ram_budget) {
+            loaded[hash] = std::move(snapshot.data);
+            return;
+        }
+        server_prefix_entry entry = std::move(it->second);
+        remove_file(entry.path);
+        disk_used -= entry.size;
+        disk.erase(it);
+        entry.path.clear();
+        entry.data = std::move(snapshot.data);
+        put_ram(hash, std::move(entry));
+    }
+
+    // settle the disk writes done by the I/O thread, a failed one drops its entry
+    void collect() {
+        for (auto it = disk.begin(); it != disk.end();) {
+            const std::shared_ptr<server_prefix_spill> spill = it->second.spill;
+            const int state = spill == nullptr ? 1 : spill->state.load(std::memory_order_acquire);
+            if (state < 0) {
+                auto next = std::next(it);
+                drop_disk(it);
+                it = next;
+                continue;
+            }
+            if (state > 0) {
+                it->second.spill.reset();
+            }
+            ++it;
+        }
+    }
+
+  private:
+    const server_prefix_entry *get_entry(uint64_t hash) const {
+        auto it = ram.find(hash);
+        if (it != ram.end()) {
+            return &it->second;
+        }
+        it = disk.find(hash);
+        return it == disk.end() ? nullptr : &it->second;
+    }
+
+    void forget(size_t n_tokens) {
+        auto it = lengths.find(n_tokens);
+        if (it != lengths.end() && --it->second <= 0) {
+            lengths.erase(it);
+        }
+    }
+
+    static std::unordered_map<uint64_t, server_prefix_entry>::iterator
+    lru(std::unordered_map<uint64_t, server_prefix_entry> &tier) {
+        auto oldest = tier.begin();
+        for (auto it = tier.begin(); it != tier.end(); it++) {
+            if (it->second.t_last_used < oldest->second.t_last_used) {
+                oldest = it;
+            }
+        }
+        return oldest;
+    }
+
+    void run_io(std::function<void()> job) {
+        if (post_io) {
+            post_io(std::move(job));
+        } else {
+            job();
+        }
+    }
+
+    // queued behind the pending writes and reads of the file
+    void remove_file(const std::string &path) {
+        run_io([path]() { std::remove(path.c_str()); });
+    }
+
+    void drop_disk(std::unordered_map<uint64_t, server_prefix_entry>::iterator it) {
+        remove_file(it->second.path);
+        loaded.erase(it->first);
+        disk_used -= it->second.size;
+        forget(it->second.tokens.size());
+        disk.erase(it);
+    }
+
+    void put_ram(uint64_t hash, server_prefix_entry &&entry) {
+        while (ram_used + entry.size > ram_budget && !ram.empty()) {
+            // spill the least recently used one to disk
+            auto victim = lru(ram);
+            const uint64_t victim_hash = victim->first;
+            server_prefix_entry spilled = std::move(victim->second);
+            ram_used -= spilled.size;
+            ram.erase(victim);
+            const size_t n_tokens = spilled.tokens.size();
+            if (!put_disk(victim_hash, std::move(spilled))) {
+                forget(n_tokens);
+            }
+        }
+        ram_used += entry.size;
+        ram[hash] = std::move(entry);
+    }
+
+    bool put_disk(uint64_t hash, server_prefix_entry &&entry) {
+        if (entry.size > disk_budget) {
+            return false;
+        }
+        while (disk_used + entry.size > disk_budget && !disk.empty()) {
+            drop_disk(lru(disk));
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "prefix-%016llx.bin", (unsigned long long)hash);
+        entry.path = disk_path + name;
+        // written on the I/O thread, a failure is settled by collect
+        std::shared_ptr<server_prefix_spill> spill(new server_prefix_spill);
+        spill->tokens = entry.tokens;
+        spill->data = std::move(entry.data);
+        entry.data = std::vector<uint8_t>();
+        entry.spill = spill;
+        const std::string path = entry.path;
+        run_io([path, spill]() {
+            const bool ok = snapshot_write(path, spill->tokens, spill->data);
+            if (!ok) {
+                std::remove(path.c_str());
+            }
+            spill->state.store(ok ? 1 : -1, std::memory_order_release);
+        });
+        disk_used += entry.size;
+        disk[hash] = std::move(entry);
+        return true;
+    }
+};
 
-    // queues
-    std::vector<server_task> queue_tasks;
-    std::vector<server_task> queue_tasks_deferred;
+struct server_queue {
+    std::atomic<int> id{0};
+    std::atomic<bool> running{false};
+
+    // queues,
+    // queue_tasks is fed by any thread and drained by the main loop only,
+    // queue_tasks_loop and queue_tasks_deferred are only touched by the main loop
+    mpsc_ring_buffer<server_task> queue_tasks{4096};
+    std::deque<server_task> queue_tasks_loop;
+    std::deque<server_task> queue_tasks_deferred;
+    std::thread::id id_loop_thread;
+
+    // scheduling policy of deferred tasks, and how long a task may be passed over by it in us,
+    // 0 = unbounded
+    server_sched_policy sched_policy = SERVER_SCHED_POLICY_FCFS;
+    int64_t sched_max_wait = 0;
+
+    // when to update the slots again if no task arrives,
+    // reset before every callback_update_slots
+    bool update_again = false;
+    std::chrono::steady_clock::time_point t_update_at =
+        std::chrono::steady_clock::time_point::max();
 
     std::vector<server_task_multi> queue_multitasks;
+    std::mutex mutex_multitasks;
 
+    // only used for sleeping while there is nothing to do
+    std::atomic<bool> sleeping{false};
     std::mutex mutex_tasks;
     std::condition_variable condition_tasks;
 
@@ -435,26 +1131,42 @@ struct server_queue {
 
     // Add a new task to the end of the queue
     int post(server_task task) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
         if (task.id == -1) {
             task.id = id++;
         }
-        queue_tasks.push_back(std::move(task));
-        condition_tasks.notify_one();
-        return task.id;
+        const int id_task = task.id;
+
+        // tasks posted by the main loop itself never go through the ring,
+        // otherwise the main loop may spin on a full ring which only it can drain
+        if (std::this_thread::get_id() == id_loop_thread) {
+            queue_tasks_loop.push_back(std::move(task));
+            return id_task;
+        }
+
+        while (!queue_tasks.push(std::move(task))) {
+            // the ring is full, wait for the main loop to drain it
+            wake();
+            std::this_thread::yield();
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.load(std::memory_order_relaxed)) {
+            wake();
+        }
+        return id_task;
     }
 
-    // Add a new task, but defer until one slot is available
+    // Add a new task, but defer until one slot is available,
+    // must only be called from the main loop
     void defer(server_task task) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
+        if (task.t_deferred < 0) {
+            task.t_deferred = ggml_time_us();
+        }
         queue_tasks_deferred.push_back(std::move(task));
     }
 
     // Get the next id for creating anew task
     int get_new_id() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        int new_id = id++;
-        return new_id;
+        return id++;
     }
 
     // Register function to process a new task
@@ -473,76 +1185,144 @@ struct server_queue {
         callback_update_slots = std::move(callback);
     }
 
-    // Call when the state of one slot is changed
+    // Request to update the slots again right after this iteration,
+    // must only be called from the main loop
+    void update_slots_again() {
+        update_again = true;
+    }
+
+    // Request to update the slots again at the given time at the latest,
+    // must only be called from the main loop
+    void update_slots_at(std::chrono::steady_clock::time_point t) {
+        t_update_at = std::min(t_update_at, t);
+    }
+
+    // Call when the state of one slot is changed,
+    // must only be called from the main loop
     void notify_slot_changed() {
+        // reorder deferred tasks by the scheduling policy,
+        // ties are broken by arrival order,
+        // the tasks waiting longer than the max go first by the time they were deferred
+        const int64_t t_starving =
+            sched_max_wait > 0 ? ggml_time_us() - sched_max_wait : INT64_MIN;
+        const auto starving = [t_starving](const server_task &t) {
+            return t.t_deferred <= t_starving;
+        };
+        const auto starving_first = [&starving](const server_task &a, const server_task &b) {
+            return starving(a) && (!starving(b) || a.t_deferred < b.t_deferred);
+        };
+        switch (sched_policy) {
+        case SERVER_SCHED_POLICY_SJF:
+            std::stable_sort(queue_tasks_deferred.begin(), queue_tasks_deferred.end(),
+                             [&](const server_task &a, const server_task &b) {
+                                 if (starving(a) || starving(b)) {
+                                     return starving_first(a, b);
+                                 }
+                                 return a.n_cost < b.n_cost;
+                             });
+            break;
+        case SERVER_SCHED_POLICY_PRIORITY:
+            std::stable_sort(queue_tasks_deferred.begin(), queue_tasks_deferred.end(),
+                             [&](const server_task &a, const server_task &b) {
+                                 if (starving(a) || starving(b)) {
+                                     return starving_first(a, b);
+                                 }
+                                 return a.priority > b.priority;
+                             });
+            break;
+        default:
+            break;
+        }
+
         // move deferred tasks back to main loop
-        std::unique_lock<std::mutex> lock(mutex_tasks);
         for (auto &task : queue_tasks_deferred) {
-            queue_tasks.push_back(std::move(task));
+            queue_tasks_loop.push_back(std::move(task));
         }
         queue_tasks_deferred.clear();
     }
 
     // End the start_loop routine
     void terminate() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
         running = false;
-        condition_tasks.notify_all();
+        wake();
+    }
+
+    // Wake up the main loop if it is sleeping
+    void wake() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        condition_tasks.notify_one();
     }
 
     /**
      * Main loop consists of these steps:
-     * - Wait until a new task arrives
+     * - Wait until a new task arrives, or the slots request another update
      * - Process the task (i.e. maybe copy data into slot)
      * - Check if multitask is finished
      * - Update all slots
      */
     void start_loop() {
+        id_loop_thread = std::this_thread::get_id();
         running = true;
 
         while (true) {
             while (true) {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
-                if (queue_tasks.empty()) {
-                    lock.unlock();
+                // dropped after each task, so that its admission is not held by the loop
+                server_task task;
+                if (!queue_tasks_loop.empty()) {
+                    task = std::move(queue_tasks_loop.front());
+                    queue_tasks_loop.pop_front();
+                } else if (!queue_tasks.pop(task)) {
                     break;
                 }
-                server_task task = queue_tasks.front();
-                queue_tasks.erase(queue_tasks.begin());
-                lock.unlock();
                 callback_new_task(task);
             }
 
             // check if we have any finished multitasks
-            auto queue_iterator = queue_multitasks.begin();
-            while (queue_iterator != queue_multitasks.end()) {
-                if (queue_iterator->subtasks_remaining.empty()) {
-                    // all subtasks done == multitask is done
-                    server_task_multi current_multitask = *queue_iterator;
-                    callback_finish_multitask(current_multitask);
-                    // remove this multitask
-                    queue_iterator = queue_multitasks.erase(queue_iterator);
-                } else {
-                    ++queue_iterator;
+            {
+                std::unique_lock<std::mutex> lock(mutex_multitasks);
+                auto queue_iterator = queue_multitasks.begin();
+                while (queue_iterator != queue_multitasks.end()) {
+                    if (queue_iterator->subtasks_remaining.empty()) {
+                        // all subtasks done == multitask is done
+                        server_task_multi current_multitask = std::move(*queue_iterator);
+                        // remove this multitask
+                        queue_iterator = queue_multitasks.erase(queue_iterator);
+                        lock.unlock();
+                        callback_finish_multitask(current_multitask);
+                        lock.lock();
+                        queue_iterator = queue_multitasks.begin();
+                    } else {
+                        ++queue_iterator;
+                    }
                 }
             }
 
             // all tasks in the current loop is processed, slots data is now
             // ready
+            update_again = false;
+            t_update_at = std::chrono::steady_clock::time_point::max();
             callback_update_slots();
 
-            {
+            // sleep until a new task arrives or the slots need another update
+            if (queue_tasks_loop.empty() && !update_again) {
                 std::unique_lock<std::mutex> lock(mutex_tasks);
+                sleeping.store(true, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
                 if (queue_tasks.empty()) {
                     if (!running) {
                         return;
                     }
-                    condition_tasks.wait(lock, [&] { return (!queue_tasks.empty() || !running); });
+                    const auto pred = [&] { return (!queue_tasks.empty() || !running); };
+                    if (t_update_at == std::chrono::steady_clock::time_point::max()) {
+                        condition_tasks.wait(lock, pred);
+                    } else {
+                        condition_tasks.wait_until(lock, t_update_at, pred);
+                    }
                 }
+                sleeping.store(false, std::memory_order_relaxed);
             }
         }
     }
-
     //
     // functions to manage multitasks
     //
@@ -550,7 +1330,7 @@ struct server_queue {
     // add a multitask by specifying the id of all subtask (subtask is a
     // server_task)
     void add_multitask(int id_multi, std::vector<int> &sub_ids) {
-        std::lock_guard<std::mutex> lock(mutex_tasks);
+        std::lock_guard<std::mutex> lock(mutex_multitasks);
         server_task_multi multi;
         multi.id = id_multi;
         std::copy(sub_ids.begin(), sub_ids.end(),
@@ -560,7 +1340,7 @@ struct server_queue {
 
     // updatethe remaining subtasks, while appending results to multitask
     void update_multitask(int id_multi, int id_sub, server_task_result &result) {
-        std::lock_guard<std::mutex> lock(mutex_tasks);
+        std::lock_guard<std::mutex> lock(mutex_multitasks);
         for (auto &multitask : queue_multitasks) {
             if (multitask.id == id_multi) {
                 multitask.subtasks_remaining.erase(id_sub);
@@ -570,49 +1350,56 @@ struct server_queue {
     }
 };
 
+// single-consumer result channel of one task
+struct server_response_channel {
+    std::deque<server_task_result> results;
+
+    std::mutex mutex;
+    std::condition_variable condition;
+};
+
 struct server_response {
     typedef std::function<void(int, int, server_task_result &)> callback_multitask_t;
     callback_multitask_t callback_update_multitask;
 
-    // for keeping track of all tasks waiting for the result
-    std::set<int> waiting_task_ids;
-
-    // the main result queue
-    std::vector<server_task_result> queue_results;
+    // channels of all tasks waiting for the result, keyed by id_task
+    std::unordered_map<int, std::shared_ptr<server_response_channel>> channels;
 
     std::mutex mutex_results;
-    std::condition_variable condition_results;
 
     // add the id_task to the list of tasks waiting for response
     void add_waiting_task_id(int id_task) {
         std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.insert(id_task);
+        if (channels.find(id_task) == channels.end()) {
+            channels[id_task] = std::make_shared<server_response_channel>();
+        }
     }
 
     // when the request is finished, we can remove task associated with it
     void remove_waiting_task_id(int id_task) {
         std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.erase(id_task);
+        channels.erase(id_task);
     }
 
     // This function blocks the thread until there is a response for this
     // id_task
     server_task_result recv(int id_task) {
-        while (true) {
+        std::shared_ptr<server_response_channel> channel;
+        {
             std::unique_lock<std::mutex> lock(mutex_results);
-            condition_results.wait(lock, [&] { return !queue_results.empty(); });
-
-            for (int i = 0; i < (int)queue_results.size(); i++) {
-                if (queue_results[i].id == id_task) {
-                    assert(queue_results[i].id_multi == -1);
-                    server_task_result res = queue_results[i];
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
-                }
+            std::shared_ptr<server_response_channel> &c = channels[id_task];
+            if (c == nullptr) {
+                c = std::make_shared<server_response_channel>();
             }
+            channel = c;
         }
 
-        // should never reach here
+        std::unique_lock<std::mutex> lock(channel->mutex);
+        channel->condition.wait(lock, [&] { return !channel->results.empty(); });
+        server_task_result res = std::move(channel->results.front());
+        channel->results.pop_front();
+        assert(res.id_multi == -1);
+        return res;
     }
 
     // Register the function to update multitask
@@ -622,23 +1409,207 @@ struct server_response {
 
     // Send a new result to a waiting id_task
     void send(server_task_result result) {
-        std::unique_lock<std::mutex> lock(mutex_results);
-        for (const auto &id_task : waiting_task_ids) {
+        std::shared_ptr<server_response_channel> channel;
+        bool multi = false;
+        {
+            std::unique_lock<std::mutex> lock(mutex_results);
             // for now, tasks that have associated parent multitasks just get
             // erased once multitask picks up the result
-            if (result.id_multi == id_task) {
-                callback_update_multitask(id_task, result.id, result);
-                continue;
+            if (result.id_multi != -1 && channels.find(result.id_multi) != channels.end()) {
+                multi = true;
             }
-
-            if (result.id == id_task) {
-                queue_results.push_back(result);
-                condition_results.notify_all();
-                return;
+            auto it = channels.find(result.id);
+            if (it != channels.end()) {
+                channel = it->second;
             }
         }
-    }
-};
+
+        if (multi) {
+            callback_update_multitask(result.id_multi, result.id, result);
+        }
+
+        if (channel != nullptr) {
+            std::unique_lock<std::mutex> lock(channel->mutex);
+            channel->results.push_back(std::move(result));
+            channel->condition.notify_one();
+        }
+    }
+};
+
+// background threads running the jobs posted by the main loop,
+// e.g. the file I/O of the slot snapshots or the pipelined decode,
+// the jobs run in order with one thread
+struct server_io_worker {
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<std::function<void()>> jobs;
+    bool running = false;
+
+    ~server_io_worker() {
+        stop();
+    }
+
+    void start(int32_t n_threads = 1) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (running) {
+            return;
+        }
+        running = true;
+        for (int32_t i = 0; i < n_threads; i++) {
+            threads.emplace_back([this]() {
+                while (true) {
+                    std::function<void()> job;
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        condition.wait(lock, [this]() { return !running || !jobs.empty(); });
+                        if (jobs.empty()) {
+                            return;
+                        }
+                        job = std::move(jobs.front());
+                        jobs.pop_front();
+                    }
+                    job();
+                }
+            });
+        }
+    }
+
+    // finish the pending jobs and join the threads
+    void stop() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            running = false;
+        }
+        condition.notify_all();
+        for (std::thread &thread : threads) {
+            if (thread.joinable()) {
+                thread.join();
+            }
+        }
+        threads.clear();
+    }
+
+    int32_t n_threads() {
+        std::unique_lock<std::mutex> lock(mutex);
+        return int32_t(threads.size());
+    }
+
+    void post(std::function<void()> job) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            jobs.push_back(std::move(job));
+        }
+        condition.notify_one();
+    }
+};
+
+// a prefix registered by name, it stays prefilled in a reserved sequence until evicted
+struct server_named_prefix {
+    std::vector<llama_token> tokens;
+    llama_seq_id seq_id = -1; // -1 if not resident in the KV cache
+    int64_t t_last_used = 0;
+};
+
+// a sampled token whose bookkeeping is deferred to overlap with the next decode
+struct server_deferred_token {
+    int32_t id_slot;
+    int id_task;
+    completion_token_output result;
+};
+
+// a slot to draft for with the draft model, from its last token at pos
+struct server_slot_draft {
+    int32_t id_slot;
+    llama_pos pos;
+    int32_t n_draft;
+    int32_t i_batch; // of the last token decoded
+};
+
+// a sampled token handed to the output thread
+struct server_output_item {
+    int32_t id_slot;
+    int id_task;
+    bool last; // the slot hit a limit, finish it after this token
+    completion_token_output result;
+};
+
+// output thread running the text work of the sampled tokens,
+// fed by the main loop through a lockless ring
+struct server_output_worker {
+    mpsc_ring_buffer<server_output_item> items{4096};
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::atomic<bool> sleeping{false};
+    std::atomic<bool> running{false};
+    // items pushed but not processed yet, per slot
+    std::unique_ptr<std::atomic<int32_t>[]> n_pending;
+
+    ~server_output_worker() {
+        stop();
+    }
+
+    void start(size_t n_slots, std::function<void(server_output_item &)> callback) {
+        n_pending.reset(new std::atomic<int32_t>[n_slots]);
+        for (size_t i = 0; i < n_slots; i++) {
+            n_pending[i].store(0, std::memory_order_relaxed);
+        }
+        running = true;
+        thread = std::thread([this, callback]() {
+            while (true) {
+                server_output_item item;
+                if (items.pop(item)) {
+                    callback(item);
+                    n_pending[item.id_slot].fetch_sub(1, std::memory_order_release);
+                    continue;
+                }
+
+                std::unique_lock<std::mutex> lock(mutex);
+                sleeping.store(true, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (items.empty()) {
+                    if (!running) {
+                        return;
+                    }
+                    condition.wait(lock, [this]() { return !items.empty() || !running; });
+                }
+                sleeping.store(false, std::memory_order_relaxed);
+            }
+        });
+    }
+
+    // finish the pending items and join the thread
+    void stop() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            running = false;
+        }
+        condition.notify_one();
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    // must only be called from the main loop
+    void push(server_output_item &&item) {
+        n_pending[item.id_slot].fetch_add(1, std::memory_order_relaxed);
+        while (!items.push(std::move(item))) {
+            // the ring is full, wait for the output thread to drain it
+            std::this_thread::yield();
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.load(std::memory_order_relaxed)) {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.notify_one();
+        }
+    }
+
+    // check if the output thread is still busy with the tokens of the slot
+    bool pending(int32_t id_slot) const {
+        return n_pending != nullptr && n_pending[id_slot].load(std::memory_order_acquire) > 0;
+    }
+};
 
 struct server_context {
     llama_model *model = nullptr;
@@ -653,9 +1624,31 @@ struct server_context {
     bool add_bos_token = true;
     bool add_eos_token = false;
 
+    // pieces of the vocabulary, read-only once loaded
+    piece_table pieces;
+
+    // tokenized text segments, thread-safe
+    mutable token_cache tokens_cache;
+
+    // token spans of the chat messages, thread-safe
+    mutable chat_cache chat_spans;
+    std::string chat_template;
+    std::vector<llama_token> chat_generation_tokens; // the generation prompt of the template
+
     int32_t n_ctx;            // total context for all clients / slots
     int32_t n_tps;            // max tokens per second
     int32_t lookup_ngram_min; // min ngram for lookup cache
+    int32_t prefill_budget;   // max prompt tokens per iteration while generating
+    int32_t n_ctx_slot;       // default context size per slot
+    int32_t n_parked;         // extra sequences to park the cached prefixes
+    int32_t n_named;          // reserved sequences to hold the named prefixes
+    int32_t n_named_ctx;      // KV cells reserved for the named prefixes
+    llama_seq_id seq_scratch; // sequence to stage a range of KV cells
+    int32_t slot_save_deltas; // max delta segments of a slot save file
+    bool elastic_ctx;         // slots draw context from the shared KV cache on demand
+
+    // slot to start batching prompts from, rotated per iteration
+    size_t i_slot_prefill = 0;
 
     // system prompt
     std::string system_prompt;
@@ -667,21 +1660,70 @@ struct server_context {
 
     server_queue queue_tasks;
     server_response queue_results;
+    server_io_worker io_worker;
+    // tokenizes the prompts of multi-prompt requests along with the HTTP threads
+    server_io_worker tokenize_workers;
+
+    // pipelined decode
+    bool pipeline;
+    bool output_thread;
+    server_io_worker decode_worker;
+    std::vector<server_deferred_token> deferred_tokens;
+
+    // output thread, and the last task it finished per slot, only touched by the output thread
+    server_output_worker output_worker;
+    std::vector<int> output_finished;
+
+    // slot save files written or read so far, keyed by the file path, and the saves staged
+    // but not written yet, shared with the I/O thread
+    std::mutex mutex_slot_saves;
+    std::unordered_map<std::string, server_slot_save_record> slot_saves;
+    std::unordered_map<std::string, int32_t> slot_saves_pending;
+
+    // quantization of the slot save files, and the fingerprint of the model they are bound to
+    slot_snapshot_quant slot_save_quant = SLOT_SNAPSHOT_QUANT_NONE;
+    uint64_t model_fingerprint = 0;
 
     server_metrics metrics;
+    server_load load;
+
+    // admission control
+    int32_t max_queued; // max tasks waiting for an available slot
+    int32_t slo_ttft;   // max estimated milliseconds to the first token
 
     // Necessary similarity of prompt for slot selection
     float slot_prompt_similarity = 0.0f;
 
+    // cross-slot prefix cache, the owners are the sequences of the idle slots and the parked
+    // sequences
+    radix_tree<llama_token> prefix_cache;
+    std::vector<int64_t> t_parked_last_used;
+    // host RAM and disk tiers of the prefix cache
+    server_prefix_store prefix_store;
+
+    // named prefixes, the reserved sequence i holds named_prefix_seqs[i] if not empty
+    std::map<std::string, server_named_prefix> named_prefixes;
+    std::vector<std::string> named_prefix_seqs;
+
     // draft-model speculative decoding
     llama_batch batch_draft;
     llama_model *model_draft = nullptr;
     llama_context *ctx_draft = nullptr;
+    bool draft_adaptive = false;
+    int32_t n_draft_tree = 0; // alternatives to the drafts per slot, on sequences after the scratch
+    // decode times in us, averaged over the batches of generated tokens
+    float t_decode_target = 0.0f;
+    float t_decode_draft = 0.0f;
     // model-free speculative decoding
     llama_ngram_cache ngram_cache_static;
     llama_ngram_cache ngram_cache_dynamic;
 
     ~server_context() {
+        output_worker.stop();
+        decode_worker.stop();
+        io_worker.stop();
+        tokenize_workers.stop();
+
         if (ctx_clip != nullptr) {
             clip_free(ctx_clip);
             ctx_clip = nullptr;
@@ -728,6 +1770,20 @@ struct server_context {
     bool load_model(const llama_box_params &bparams) {
         params = bparams.gparams;
 
+        // besides the slots, one sequence for the system prompt, the parked prefixes, the named
+        // prefixes, one scratch sequence and the draft branches of the slots
+        const int32_t n_seq_reserved = 1 + bparams.n_prefix_cache_parked +
+                                       bparams.n_named_prefixes + 1 +
+                                       bparams.gparams.n_parallel * bparams.draft_tree;
+
+        n_named = bparams.n_named_prefixes;
+        n_named_ctx = 0;
+        if (n_named > 0) {
+            n_named_ctx = bparams.named_prefixes_ctx > 0 ? bparams.named_prefixes_ctx
+                                                         : 4096 * n_named;
+            named_prefix_seqs.resize(n_named);
+        }
+
         // load multimodal projection model
         if (!params.mmproj.empty()) {
             if (params.n_ctx < 2048) {
@@ -749,6 +1805,10 @@ struct server_context {
             params_draft.n_threads = params.n_threads_draft;
             params_draft.n_threads_batch = params.n_threads_batch_draft;
             params_draft.warmup = false;
+            params_draft.n_parallel += n_seq_reserved;
+            if (params_draft.n_ctx > 0) {
+                params_draft.n_ctx += n_named_ctx;
+            }
             llama_init_result ir = llama_init_from_gpt_params(params_draft);
             model_draft = ir.model;
             ctx_draft = ir.context;
@@ -778,13 +1838,19 @@ struct server_context {
             }
         }
 
-        // dedicate one sequence to the system prompt
-        params.n_parallel += 1;
+        // dedicate the reserved sequences
+        const int32_t n_ctx_user = params.n_ctx;
+        params.n_parallel += n_seq_reserved;
+        if (params.n_ctx > 0) {
+            params.n_ctx += n_named_ctx;
+        }
         llama_init_result ir = llama_init_from_gpt_params(params);
         model = ir.model;
         ctx = ir.context;
         lora_adapters = ir.lora_adapters;
-        params.n_parallel -= 1; // but be sneaky about it
+        // but be sneaky about it
+        params.n_parallel -= n_seq_reserved;
+        params.n_ctx = n_ctx_user;
         if (model == nullptr) {
             LOG_ERROR("unable to load model", {{"model", params.model}});
             return false;
@@ -820,13 +1886,81 @@ struct server_context {
             }
         }
 
+        // the KV cells reserved for the named prefixes are not shared by the slots, with the
+        // default context size nothing is reserved on top of it
         n_ctx = int32_t(llama_n_ctx(ctx));
+        if (n_ctx_user > 0) {
+            n_ctx -= n_named_ctx;
+        } else if (n_named_ctx > 0) {
+            LOG_WARNING("named prefixes share the context of the slots, set --ctx-size to "
+                        "reserve their KV cells",
+                        {{"n_ctx", n_ctx}, {"n_named_ctx", n_named_ctx}});
+        }
+        if (n_ctx <= 0) {
+            LOG_ERROR("named prefixes take the whole context",
+                      {{"n_ctx", llama_n_ctx(ctx)}, {"n_named_ctx", n_named_ctx}});
+            return false;
+        }
         n_tps = bparams.n_tps;
         lookup_ngram_min = bparams.lookup_ngram_min;
+        prefill_budget = bparams.prefill_budget;
+        pipeline = bparams.pipeline;
+        draft_adaptive = bparams.draft_adaptive;
+        n_draft_tree = bparams.draft_tree;
+        output_thread = bparams.output_thread;
+        elastic_ctx = bparams.elastic_ctx;
+        n_parked = bparams.n_prefix_cache_parked;
+        seq_scratch = params.n_parallel + 1 + n_parked + n_named;
+        slot_save_deltas = bparams.slot_save_deltas;
+        if (bparams.slot_save_quant == "q8_0") {
+            slot_save_quant = SLOT_SNAPSHOT_QUANT_Q8_0;
+        } else if (bparams.slot_save_quant == "q4_0") {
+            slot_save_quant = SLOT_SNAPSHOT_QUANT_Q4_0;
+        }
+        {
+            char desc[256] = {0};
+            llama_model_desc(model, desc, sizeof(desc));
+            const int64_t dims[] = {int64_t(llama_model_n_params(model)), llama_n_embd(model),
+                                    llama_n_layer(model), llama_n_vocab(model)};
+            uint64_t h = snapshot_hash_init();
+            h = snapshot_hash_bytes(h, desc, strlen(desc));
+            h = snapshot_hash_bytes(h, dims, sizeof(dims));
+            h = snapshot_hash_bytes(h, params.cache_type_k.data(), params.cache_type_k.size());
+            h = snapshot_hash_bytes(h, params.cache_type_v.data(), params.cache_type_v.size());
+            model_fingerprint = h;
+        }
+        t_parked_last_used.resize(n_parked, -1);
+        if (ctx_draft == nullptr) {
+            prefix_store.ram_budget = size_t(bparams.prefix_cache_ram) << 20;
+            if (!bparams.gparams.slot_save_path.empty()) {
+                prefix_store.disk_budget = size_t(bparams.prefix_cache_disk) << 20;
+                prefix_store.disk_path = bparams.gparams.slot_save_path;
+                prefix_store.post_io = [this](std::function<void()> job) {
+                    io_worker.post(std::move(job));
+                };
+            } else if (bparams.prefix_cache_disk > 0) {
+                LOG_WARNING("prefix cache disk tier requires --slot-save-path, disabling it", {});
+            }
+        } else if (bparams.prefix_cache_ram > 0 || bparams.prefix_cache_disk > 0) {
+            LOG_WARNING("prefix cache tiers are not supported with draft model, disabling them",
+                        {});
+        }
+        max_queued = bparams.max_queued;
+        slo_ttft = bparams.slo_ttft;
+        if (bparams.sched_policy == "sjf") {
+            queue_tasks.sched_policy = SERVER_SCHED_POLICY_SJF;
+        } else if (bparams.sched_policy == "priority") {
+            queue_tasks.sched_policy = SERVER_SCHED_POLICY_PRIORITY;
+        }
+        queue_tasks.sched_max_wait = int64_t(bparams.sched_max_wait) * 1000000;
 
         add_bos_token = llama_should_add_bos_token(model);
         add_eos_token = llama_add_eos_token(model);
 
+        pieces.build(model);
+        tokens_cache.init(size_t(bparams.tokenize_cache));
+        chat_spans.init(size_t(bparams.chat_cache));
+
         // sample tokens per second
         if (n_tps < 0) {
             LOG_INFO("sampling tokens per second, this will take some time...", {});
@@ -872,10 +2006,174 @@ struct server_context {
         return "chatml"; // see llama_chat_apply_template_internal
     }
 
+    std::string render_chat(const llama_chat_msg *msgs, size_t n, bool add_ass) const {
+        const std::vector<llama_chat_msg> chat(msgs, msgs + n);
+        return llama_chat_apply_template(model, chat_template, chat, add_ass);
+    }
+
+    // tokenizing two runs separately gives the tokens of the concatenation
+    // if they meet at a special token, which the tokenizer splits on first
+    bool can_split(const std::vector<llama_token> &a, const std::vector<llama_token> &b) const {
+        return a.empty() || b.empty() ||
+               (pieces.flags(a.back()) & piece_table::PIECE_FLAG_SPECIAL) ||
+               (pieces.flags(b.front()) & piece_table::PIECE_FLAG_SPECIAL);
+    }
+
+    // the chat cache needs a template that renders a message regardless of the ones before it,
+    // but the first two which may be merged, e.g. the system message into the first user one
+    void init_chat_cache(const std::string &tmpl) {
+        if (!chat_spans.enabled()) {
+            return;
+        }
+        chat_template = tmpl;
+
+        const std::vector<llama_chat_msg> probe = {
+            {"system", "You are a helpful assistant."},
+            {"user", "Hello."},
+            {"assistant", "Hi, how may I help you?"},
+            {"user", "Tell me a joke."},
+            {"assistant", "Why did the chicken cross the road?"},
+            {"user", "Why?"},
+        };
+        bool separable = true;
+        try {
+            const std::string full = render_chat(probe.data(), probe.size(), false);
+            const std::string full_ass = render_chat(probe.data(), probe.size(), true);
+            separable = full_ass.compare(0, full.size(), full) == 0;
+
+            // the first two rendered together, then each message alone, must add up to the whole
+            std::string text;
+            std::vector<llama_token> tokens;
+            for (size_t i = 0; separable && i < probe.size();) {
+                const size_t n = i == 0 ? 2 : 1;
+                const std::string part = render_chat(probe.data() + i, n, false);
+                const std::vector<llama_token> next = llama_tokenize(ctx, part, false, true);
+                separable = can_split(tokens, next);
+                text += part;
+                tokens.insert(tokens.end(), next.begin(), next.end());
+                i += n;
+            }
+            separable = separable && text == full;
+            chat_generation_tokens = llama_tokenize(ctx, full_ass.substr(full.size()), false, true);
+            separable = separable && can_split(tokens, chat_generation_tokens);
+
+            // and tokenize to the same ids, e.g. not for a tokenizer that prefixes a space
+            // after a special token
+            tokens.insert(tokens.end(), chat_generation_tokens.begin(),
+                          chat_generation_tokens.end());
+            separable = separable && tokens == llama_tokenize(ctx, full_ass, false, true);
+        } catch (const std::exception &e) {
+            LOG_WARNING("failed to probe chat template", {{"error", e.what()}});
+            separable = false;
+        }
+        if (!separable) {
+            LOG_WARNING("chat template renders messages depending on the previous ones, "
+                        "disabling chat cache",
+                        {});
+            chat_spans.init(0);
+            return;
+        }
+        LOG_INFO("chat cache", {{"n_generation_tokens", chat_generation_tokens.size()}});
+    }
+
+    // tokenize the messages of a chat, the spans of the messages seen in the previous turns are
+    // looked up, only the new ones are rendered and tokenized,
+    // returns false if it has to be rendered as a whole, e.g. for the images
+    bool tokenize_chat(const json &messages, bool add_special,
+                       std::vector<llama_token> &out) const {
+        if (!chat_spans.enabled() || chat_template.empty() || !messages.is_array() ||
+            messages.empty()) {
+            return false;
+        }
+
+        const size_t n_msgs = messages.size();
+        std::vector<llama_chat_msg> chat;
+        std::vector<uint64_t> keys;
+        std::vector<std::string> texts; // the spans are checked against
+        chat.reserve(n_msgs);
+        keys.reserve(n_msgs);
+        texts.reserve(n_msgs);
+        uint64_t h = chat_cache::seed(add_special);
+        for (const json &msg : messages) {
+            if (msg.contains("content") && msg.at("content").is_array()) {
+                for (const json &part : msg.at("content")) {
+                    if (json_value(part, "type", std::string()) == "image_url") {
+                        return false;
+                    }
+                }
+            }
+            chat.push_back(parse_chat_msg(msg));
+            h = chat_cache::chain(h, chat.back().role, chat.back().content);
+            keys.push_back(h);
+            texts.push_back(chat_cache::text(chat.back().role, chat.back().content));
+        }
+
+        // find the longest prefix whose spans are all cached
+        std::vector<std::pair<size_t, size_t>> spans; // [begin, end), the last one first
+        size_t n_cached = n_msgs;
+        for (; n_cached > 0; n_cached--) {
+            spans.clear();
+            size_t i = n_cached;
+            while (i > 0) {
+                const auto n = size_t(chat_spans.find(keys[i - 1], texts, i, add_special));
+                if (n == 0) {
+                    break;
+                }
+                spans.emplace_back(i - n, i);
+                i -= n;
+            }
+            if (i == 0) {
+                break;
+            }
+        }
+        if (n_cached == 0) {
+            spans.clear();
+        }
+        for (auto it = spans.rbegin(); it != spans.rend(); it++) {
+            const std::string text = chat_cache::text(texts, it->first, it->second, add_special);
+            if (!chat_spans.get(keys[it->second - 1], text, out)) {
+                out.clear();
+                n_cached = 0;
+                break;
+            }
+        }
+
+        // render and tokenize the new messages, the first two together
+        for (size_t i = n_cached; i < n_msgs;) {
+            const size_t n = i == 0 ? std::min(n_msgs, size_t(2)) : 1;
+            const std::string text = render_chat(chat.data() + i, n, false);
+            const std::vector<llama_token> tokens =
+                llama_tokenize(ctx, text, i == 0 && add_special, true);
+            if (!can_split(out, tokens)) {
+                out.clear();
+                return false;
+            }
+            if (i + n >= 2) {
+                chat_spans.put(keys[i + n - 1],
+                               chat_cache::text(texts, i, i + n, add_special), int32_t(n),
+                               tokens);
+            }
+            out.insert(out.end(), tokens.begin(), tokens.end());
+            i += n;
+        }
+        if (!can_split(out, chat_generation_tokens)) {
+            out.clear();
+            return false;
+        }
+        out.insert(out.end(), chat_generation_tokens.begin(), chat_generation_tokens.end());
+        return true;
+    }
+
     bool init() {
         LOG_INFO("initializing slots", {{"n_slots", params.n_parallel}});
 
-        const int32_t n_ctx_slot = n_ctx / params.n_parallel;
+        io_worker.start();
+        if (pipeline) {
+            decode_worker.start();
+        }
+        tokenize_workers.start(std::max(1, int32_t(std::thread::hardware_concurrency() / 2) - 1));
+
+        n_ctx_slot = elastic_ctx ? n_ctx : n_ctx / params.n_parallel;
         for (int i = 0; i < params.n_parallel; i++) {
             server_slot slot;
 
@@ -908,6 +2206,13 @@ struct server_context {
 
             slots.push_back(slot);
         }
+        load.n_slots = int32_t(slots.size());
+
+        if (output_thread) {
+            output_finished.assign(slots.size(), -1);
+            output_worker.start(slots.size(),
+                                [this](server_output_item &item) { process_output(item); });
+        }
 
         default_generation_settings_for_props = get_formated_generation(slots.front());
         default_generation_settings_for_props["seed"] = -1;
@@ -916,7 +2221,8 @@ struct server_context {
         // tokens note that n_batch can be > n_ctx (e.g. for non-causal
         // attention models such as BERT where the KV cache is not used)
         const auto n_batch = int32_t(llama_n_batch(ctx));
-        batch = llama_batch_init(n_batch, 0, 1);
+        // the tokens shared by the draft branches carry their sequences as well
+        batch = llama_batch_init(n_batch, 0, 1 + n_draft_tree);
         if (ctx_draft != nullptr) {
             batch_draft = llama_batch_init(n_batch, 0, 1);
         }
@@ -978,36 +2284,35 @@ struct server_context {
         // or the first element of the json_prompt array is a string.
         std::vector<llama_token> prompt_tokens;
 
+        // go through the cache for the segments worth it
+        const auto tokenize_segment = [&](const std::string &s, bool add) {
+            if (!tokens_cache.enabled() || s.size() < token_cache::MIN_TEXT) {
+                const std::vector<llama_token> p = llama_tokenize(ctx, s, add, TMP_FORCE_SPECIAL);
+                prompt_tokens.insert(prompt_tokens.end(), p.begin(), p.end());
+                return;
+            }
+            if (!tokens_cache.get(s, add, prompt_tokens)) {
+                const std::vector<llama_token> p = llama_tokenize(ctx, s, add, TMP_FORCE_SPECIAL);
+                tokens_cache.put(s, add, p);
+                prompt_tokens.insert(prompt_tokens.end(), p.begin(), p.end());
+            }
+        };
+
         if (prompt.is_array()) {
             bool first = true;
             for (const json &jp : prompt) {
                 if (jp.is_string()) {
-                    std::string s = jp.get<std::string>();
-                    std::vector<llama_token> p;
-                    if (first) {
-                        p = llama_tokenize(ctx, s, add_special, TMP_FORCE_SPECIAL);
-                        first = false;
-                    } else {
-                        p = llama_tokenize(ctx, s, false, TMP_FORCE_SPECIAL);
-                    }
-                    prompt_tokens.insert(prompt_tokens.end(), p.begin(), p.end());
+                    tokenize_segment(jp.get<std::string>(), first && add_special);
+                    first = false;
                 } else if (jp.is_object() && jp.contains("text")) {
-                    std::string s = json_value(jp, "text", std::string());
-                    std::vector<llama_token> p;
-                    if (first) {
-                        p = llama_tokenize(ctx, s, add_special, TMP_FORCE_SPECIAL);
-                        first = false;
-                    } else {
-                        p = llama_tokenize(ctx, s, false, TMP_FORCE_SPECIAL);
-                    }
-                    prompt_tokens.insert(prompt_tokens.end(), p.begin(), p.end());
+                    tokenize_segment(json_value(jp, "text", std::string()), first && add_special);
+                    first = false;
                 } else if (jp.is_number()) {
                     prompt_tokens.push_back(jp.get<llama_token>());
                 }
             }
         } else {
-            std::string s = prompt.get<std::string>();
-            prompt_tokens = llama_tokenize(ctx, s, add_special, TMP_FORCE_SPECIAL);
+            tokenize_segment(prompt.get<std::string>(), add_special);
         }
 
         return prompt_tokens;
@@ -1023,9 +2328,14 @@ struct server_context {
         return nullptr;
     }
 
-    server_slot *get_available_slot(const std::string &prompt) {
+    server_slot *get_available_slot(const server_task &task) {
         server_slot *ret = nullptr;
 
+        std::string prompt;
+        if (task.data.contains("prompt") && task.data.at("prompt").is_string()) {
+            prompt = json_value(task.data, "prompt", std::string());
+        }
+
         // find the slot that has at least n% prompt similarity
         if (ret == nullptr && slot_prompt_similarity != 0.0f && !prompt.empty()) {
             int max_lcp_len = 0;
@@ -1064,6 +2374,26 @@ struct server_context {
             }
         }
 
+        // find the slot that has at least n% of its cached tokens in the tokenized prompt,
+        // e.g. the previous turns of the chat
+        if (ret == nullptr && slot_prompt_similarity != 0.0f && prompt.empty() &&
+            !task.prompt_tokens.empty()) {
+            size_t max_lcp_len = 0;
+
+            for (server_slot &slot : slots) {
+                if (!slot.available() || slot.cache_tokens.empty()) {
+                    continue;
+                }
+
+                const size_t lcp_len = common_part(slot.cache_tokens, task.prompt_tokens);
+                const float similarity = float(lcp_len) / float(slot.cache_tokens.size());
+                if (lcp_len > max_lcp_len && similarity > slot_prompt_similarity) {
+                    max_lcp_len = lcp_len;
+                    ret = &slot;
+                }
+            }
+        }
+
         // find the slot that has been least recently used
         if (ret == nullptr) {
             int64_t t_last = ggml_time_us();
@@ -1102,6 +2432,19 @@ struct server_context {
         slot.params.input_prefix = json_value(data, "input_prefix", params.input_prefix);
         slot.params.input_suffix = json_value(data, "input_suffix", params.input_suffix);
 
+        // cap the context size of this request
+        slot.n_ctx = n_ctx_slot;
+        {
+            const int32_t n_ctx_req = json_value(data, "n_ctx", 0);
+            if (n_ctx_req < 0 || (n_ctx_req > 0 && n_ctx_req < 16)) {
+                send_error(task, "\"n_ctx\" must be at least 16", ERROR_TYPE_INVALID_REQUEST);
+                return false;
+            }
+            if (n_ctx_req > 0) {
+                slot.n_ctx = std::min(slot.n_ctx, n_ctx_req);
+            }
+        }
+
         slot.sparams.top_k = json_value(data, "top_k", sparams.top_k);
         slot.sparams.top_p = json_value(data, "top_p", sparams.top_p);
         slot.sparams.min_p = json_value(data, "min_p", sparams.min_p);
@@ -1175,6 +2518,37 @@ struct server_context {
             if (slot.oaicompat_completion_chat_vision) {
                 slot.params.cache_prompt = false;
             }
+
+            // fork from the named prefix
+            const std::string id_prefix = json_value(data, "id_prefix", std::string());
+            if (!id_prefix.empty()) {
+                auto it = named_prefixes.find(id_prefix);
+                if (it == named_prefixes.end()) {
+                    send_error(task, "Unknown prefix ID", ERROR_TYPE_INVALID_REQUEST);
+                    return false;
+                }
+                if (slot.oaicompat_completion_chat_vision) {
+                    send_error(task, "\"id_prefix\" is not supported with images",
+                               ERROR_TYPE_INVALID_REQUEST);
+                    return false;
+                }
+                // if it was evicted, the slot prefills it as part of the prompt in the batches,
+                // and it is taken back to the KV cache from there
+                if (it->second.seq_id < 0) {
+                    slot.named_prefix_pending = id_prefix;
+                }
+                it->second.t_last_used = ggml_time_us();
+                slot.prefix_tokens = it->second.tokens;
+                slot.params.cache_prompt = slot.ga_n == 1;
+            }
+        }
+
+        // tokenized by the HTTP thread already
+        if (task.tokenized) {
+            slot.prompt_tokens_staged = slot.prefix_tokens;
+            slot.prompt_tokens_staged.insert(slot.prompt_tokens_staged.end(),
+                                             task.prompt_tokens.begin(), task.prompt_tokens.end());
+            slot.prompt_staged = true;
         }
 
         // penalize user-provided tokens
@@ -1264,6 +2638,17 @@ struct server_context {
                     }
                 }
             }
+
+            // the token ids only catch the stop words generated the way they tokenize alone
+            slot.stop_text.clear();
+            slot.stop_tokens.clear();
+            for (const std::string &word : slot.params.antiprompt) {
+                slot.stop_text.add(word.data(), word.size());
+                const std::vector<llama_token> word_toks = llama_tokenize(ctx, word, false);
+                slot.stop_tokens.add(word_toks.data(), word_toks.size());
+            }
+            slot.stop_text.build();
+            slot.stop_tokens.build();
         }
 
         {
@@ -1326,6 +2711,10 @@ struct server_context {
             llama_sampling_params sparams_draft = slot.sparams;
             // the draft samplers will copy the target sampler's grammar.
             sparams_draft.grammar.clear();
+            // the acceptance draws of the target must not follow the draws of the drafts
+            if (sparams_draft.seed != LLAMA_DEFAULT_SEED) {
+                sparams_draft.seed += 1;
+            }
             slot.ctx_sampling_draft = llama_sampling_init(sparams_draft);
             if (slot.ctx_sampling_draft == nullptr) {
                 // for now, the only error that may happen here is invalid
@@ -1335,6 +2724,19 @@ struct server_context {
             }
         }
 
+        slot.draft_stochastic = (ctx_draft != nullptr || lookup_ngram_min > 0) &&
+                                slot.sparams.temp > 0.0f && slot.sparams.mirostat == 0 &&
+                                slot.sparams.grammar.empty();
+        slot.n_draft = params.n_draft;
+        slot.n_draft_paused = 0;
+        slot.draft_accepted_ewma = 0.5f;
+        slot.draft_accepted_hist.clear();
+        if (ctx_draft != nullptr || lookup_ngram_min > 0) {
+            slot.draft_accepted_hist.assign(params.n_draft + 1, 0);
+        }
+        slot.draft_tail.clear();
+        slot.n_past_draft = -1;
+
         if (lookup_ngram_min > 0) {
             slot.lookup_ngram_min = lookup_ngram_min;
             if (!slot.ctx_ngram_cache.empty()) {
@@ -1374,13 +2776,11 @@ struct server_context {
         return true;
     }
 
-    bool process_token(completion_token_output &result, server_slot &slot) {
-        // remember which tokens were sampled - used for repetition penalties
-        // during sampling
+    // remember which tokens were sampled - used for repetition penalties
+    // during sampling
+    static void push_sampled(const completion_token_output &result, server_slot &slot) {
         slot.sampled.clear();
-        std::string token_str;
         for (const llama_token &tok : result.toks) {
-            token_str += llama_token_to_piece(ctx, tok, params.special);
             slot.sampled.push_back(tok);
             if (slot.ctx_sampling->params.use_penalty_prompt_tokens && tok != -1) {
                 // we can change penalty_prompt_tokens because it is always created
@@ -1388,10 +2788,19 @@ struct server_context {
                 slot.ctx_sampling->params.penalty_prompt_tokens.push_back(tok);
             }
         }
+    }
 
+    // detokenize the sampled tokens and stream the text without the stop words,
+    // returns true if a full stop word was generated
+    bool process_token_text(completion_token_output &result, server_slot &slot,
+                            std::string &stop_word) {
         // search stop word and delete it
-        slot.generated_text += token_str;
-        slot.has_next_token = true;
+        const size_t n_generated = slot.generated_text.size();
+        for (const llama_token &tok : result.toks) {
+            pieces.append(slot.generated_text, tok, params.special);
+        }
+        slot.stop_text.feed(slot.generated_text.data() + n_generated,
+                            slot.generated_text.size() - n_generated);
 
         // check if there is incomplete UTF-8 character at the end
         bool incomplete = false;
@@ -1415,23 +2824,21 @@ struct server_context {
             break;
         }
 
+        bool is_stop_full = false;
         if (!incomplete) {
             size_t pos = std::min(slot.n_sent_text, slot.generated_text.size());
 
-            const std::string str_test = slot.generated_text.substr(pos);
-            bool is_stop_full = false;
-
-            size_t stop_pos =
-                slot.find_stopping_strings(str_test, token_str.size(), STOP_TYPE_FULL);
+            int32_t i_word = -1;
+            size_t stop_pos = slot.stop_text.full_match(pos, i_word);
             if (stop_pos != std::string::npos) {
                 is_stop_full = true;
+                stop_word = slot.params.antiprompt[i_word];
                 slot.generated_text.erase(slot.generated_text.begin() + long(pos) + long(stop_pos),
                                           slot.generated_text.end());
                 pos = std::min(slot.n_sent_text, slot.generated_text.size());
             } else {
                 is_stop_full = false;
-                stop_pos =
-                    slot.find_stopping_strings(str_test, token_str.size(), STOP_TYPE_PARTIAL);
+                stop_pos = slot.stop_text.partial_match(pos);
             }
 
             // check if there is any token to predict
@@ -1442,16 +2849,18 @@ struct server_context {
                 // add the token to slot queue and cache
             }
 
-            slot.add_token_string(result);
+            slot.generated_token_probs.push_back(result);
             if (slot.params.stream) {
                 send_partial_response(slot, result);
             }
         }
 
-        if (incomplete) {
-            slot.has_next_token = true;
-        }
+        return is_stop_full;
+    }
 
+    // check the stopping conditions told by the tokens alone: the budget, EOG and n_ctx_train,
+    // returns false if the slot must stop
+    bool process_token_limits(const completion_token_output &result, server_slot &slot) {
         // check the limits
         if (slot.n_decoded > 0 && slot.has_next_token && !slot.has_budget(params)) {
             slot.stopped_limit = true;
@@ -1494,6 +2903,62 @@ struct server_context {
         return slot.has_next_token; // continue
     }
 
+    bool process_token(completion_token_output &result, server_slot &slot) {
+        std::string stop_word;
+        slot.has_next_token = true;
+        if (process_token_text(result, slot, stop_word)) {
+            slot.stopped_word = true;
+            slot.stopping_word = stop_word;
+            slot.has_next_token = false;
+        }
+        return process_token_limits(result, slot);
+    }
+
+    // check if the sampled tokens complete a stop word as it tokenizes alone,
+    // the text is still checked for the stop words generated in other ways
+    static bool match_stop_tokens(const completion_token_output &result, server_slot &slot) {
+        int32_t i_word = -1;
+        slot.stop_tokens.feed(result.toks.data(), result.toks.size());
+        return slot.stop_tokens.full_match(0, i_word) != std::string::npos;
+    }
+
+    // hand the text work of the sampled tokens to the output thread,
+    // a slot hitting a limit or a stop word is no longer scheduled and waits for its final
+    // response
+    void emit_token(server_slot &slot, completion_token_output &&result) {
+        slot.has_next_token = true;
+        const bool limited = !process_token_limits(result, slot);
+        const bool last = match_stop_tokens(result, slot) || limited;
+        slot.finishing = last;
+        output_worker.push({slot.id, slot.id_task, last, std::move(result)});
+    }
+
+    // text work of a sampled token on the output thread, the main loop leaves the text of
+    // the slot alone until the output thread reports the slot finished
+    void process_output(server_output_item &item) {
+        if (output_finished[item.id_slot] == item.id_task) {
+            return;
+        }
+        server_slot &slot = slots[item.id_slot];
+
+        std::string stop_word;
+        const bool stopped_word = process_token_text(item.result, slot, stop_word);
+        if (!stopped_word && !item.last) {
+            return;
+        }
+        output_finished[item.id_slot] = item.id_task;
+
+        server_task task;
+        task.type = SERVER_TASK_TYPE_SLOT_FINISH;
+        task.data = json{
+            {"id_slot", item.id_slot},
+            {"id_task", item.id_task},
+            {"stopped_word", stopped_word},
+            {"stopping_word", stop_word},
+        };
+        queue_tasks.post(std::move(task));
+    }
+
     json get_formated_generation(const server_slot &slot) const {
         const auto eos_bias = slot.sparams.logit_bias.find(llama_token_eos(model));
         const bool ignore_eos = eos_bias != slot.sparams.logit_bias.end() &&
@@ -1596,7 +3061,7 @@ struct server_context {
             slot.n_sent_token_probs = probs_stop_pos;
 
             res.data["completion_probabilities"] = probs_vector_to_json(
-                ctx, probs_output, slot.oaicompat_completion, slot.oaicompat_completion_chat);
+                pieces, probs_output, slot.oaicompat_completion, slot.oaicompat_completion_chat);
         }
 
         queue_results.send(res);
@@ -1640,7 +3105,7 @@ struct server_context {
             }
 
             res.data["completion_probabilities"] = probs_vector_to_json(
-                ctx, probs, slot.oaicompat_completion, slot.oaicompat_completion_chat);
+                pieces, probs, slot.oaicompat_completion, slot.oaicompat_completion_chat);
         }
 
         queue_results.send(res);
@@ -1689,9 +3154,9 @@ struct server_context {
         queue_results.send(res);
     }
 
+    // the task may come admitted, with its prompt tokenized already
     void request_completion(int id_task, int id_multi, json data, bool infill, bool embedding,
-                            int tps = 0) {
-        server_task task;
+                            int tps = 0, int priority = 0, server_task task = server_task()) {
         task.id = id_task;
         task.id_multi = id_multi;
         task.id_target = 0;
@@ -1700,36 +3165,71 @@ struct server_context {
         task.embedding = embedding;
         task.type = SERVER_TASK_TYPE_COMPLETION;
         task.tps = tps;
+        task.priority = priority;
 
         // when a completion task's prompt array is not a singleton, we split it
         // into multiple requests otherwise, it's a single-prompt task, we
         // actually queue it if there's numbers in the prompt array it will be
         // treated as an array of tokens
-        bool chat_vision = json_value(task.data, "__oaicompat_completion_chat_vision", false);
-        if (!chat_vision && task.data.count("prompt") != 0 && task.data.at("prompt").size() > 1) {
-            bool numbers = false;
-            for (const auto &e : task.data.at("prompt")) {
-                if (e.is_number()) {
-                    numbers = true;
-                    break;
-                }
+        if (is_multiprompt(task.data)) {
+            split_multiprompt_task(id_task, task);
+        } else {
+            if (!task.tokenized) {
+                tokenize_task(task);
             }
+            queue_tasks.post(std::move(task));
+        }
+    }
 
-            // NOTE: split_multiprompt_task() does not handle a mix of strings
-            // and numbers, it will completely stall the server. I don't know
-            // where the bug for this is.
-            //
-            // if there are numbers, it needs to be treated like a single
-            // prompt, queue_tasks handles a mix of strings and numbers just
-            // fine.
-            if (numbers) {
-                queue_tasks.post(task);
-            } else {
-                split_multiprompt_task(id_task, task);
+    static bool is_multiprompt(const json &data) {
+        bool chat_vision = json_value(data, "__oaicompat_completion_chat_vision", false);
+        if (chat_vision || data.count("prompt") == 0 || data.at("prompt").size() <= 1) {
+            return false;
+        }
+
+        // NOTE: split_multiprompt_task() does not handle a mix of strings
+        // and numbers, it will completely stall the server. I don't know
+        // where the bug for this is.
+        //
+        // if there are numbers, it needs to be treated like a single
+        // prompt, queue_tasks handles a mix of strings and numbers just
+        // fine.
+        for (const auto &e : data.at("prompt")) {
+            if (e.is_number()) {
+                return false;
             }
+        }
+        return true;
+    }
+
+    // tokenize the prompt of a completion task on the calling thread, i.e. an HTTP thread,
+    // so that the main loop gets ready-to-batch token ids,
+    // the images and the named prefix are left to the main loop
+    void tokenize_task(server_task &task) const {
+        task.tokenized = tokenize_prompt(task.data, task.infill, task.prompt_tokens);
+    }
+
+    // the prompt tokens of the task data, returns false if left to the main loop
+    bool tokenize_prompt(const json &data, bool infill, std::vector<llama_token> &out) const {
+        if (json_value(data, "__oaicompat_completion_chat_vision", false)) {
+            return false;
+        }
+        if (infill) {
+            const json input_prefix = json_value(data, "input_prefix", params.input_prefix);
+            const json input_suffix = json_value(data, "input_suffix", params.input_suffix);
+            out = tokenize_infill(input_prefix, input_suffix);
         } else {
-            queue_tasks.post(task);
+            const auto prompt = data.find("prompt");
+            if (prompt == data.end() ||
+                !(prompt->is_string() || (prompt->is_array() && !prompt->empty()))) {
+                return false;
+            }
+            // the named prefix has BOS already
+            const bool add_special =
+                system_prompt.empty() && json_value(data, "id_prefix", std::string()).empty();
+            out = tokenize(*prompt, add_special);
         }
+        return true;
     }
 
     void request_cancel(int id_task) {
@@ -1737,7 +3237,7 @@ struct server_context {
         task.type = SERVER_TASK_TYPE_CANCEL;
         task.id_target = id_task;
 
-        queue_tasks.post(task);
+        queue_tasks.post(std::move(task));
     }
 
     void split_multiprompt_task(int id_multi, const server_task &multiprompt_task) {
@@ -1756,19 +3256,97 @@ struct server_context {
         // queue up the multitask so we can track its subtask progression
         queue_tasks.add_multitask(id_multi, subtask_ids);
 
-        // add subtasks
+        // add subtasks, they inherit everything else (infill mode, embedding mode, etc.)
+        std::vector<server_task> subtasks;
         for (int i = 0; i < prompt_count; i++) {
             json subtask_data = multiprompt_task.data;
             subtask_data["prompt"] = subtask_data.at("prompt")[i];
 
-            // subtasks inherit everything else (infill mode, embedding mode,
-            // etc.)
-            request_completion(subtask_ids[i], id_multi, subtask_data, multiprompt_task.infill,
-                               multiprompt_task.embedding, multiprompt_task.tps);
+            if (is_multiprompt(subtask_data)) {
+                request_completion(subtask_ids[i], id_multi, subtask_data, multiprompt_task.infill,
+                                   multiprompt_task.embedding, multiprompt_task.tps,
+                                   multiprompt_task.priority);
+                continue;
+            }
+
+            server_task subtask;
+            subtask.id = subtask_ids[i];
+            subtask.id_multi = id_multi;
+            subtask.id_target = 0;
+            subtask.data = std::move(subtask_data);
+            subtask.infill = multiprompt_task.infill;
+            subtask.embedding = multiprompt_task.embedding;
+            subtask.type = SERVER_TASK_TYPE_COMPLETION;
+            subtask.tps = multiprompt_task.tps;
+            subtask.priority = multiprompt_task.priority;
+            subtasks.push_back(std::move(subtask));
+        }
+
+        // tokenize the prompts on this thread and the shared tokenize workers, then queue up the
+        // subtasks in order
+        const auto n_subtasks = int32_t(subtasks.size());
+        const int32_t n_threads = std::min(n_subtasks, 1 + tokenize_workers.n_threads());
+        const auto tokenize_subtasks = [this, &subtasks, n_subtasks, n_threads](int32_t t) {
+            for (int32_t i = t; i < n_subtasks; i += n_threads) {
+                tokenize_task(subtasks[i]);
+            }
+        };
+        std::vector<std::future<void>> workers;
+        for (int32_t t = 1; t < n_threads; t++) {
+            auto job = std::make_shared<std::packaged_task<void()>>(
+                [&tokenize_subtasks, t]() { tokenize_subtasks(t); });
+            workers.push_back(job->get_future());
+            tokenize_workers.post([job]() { (*job)(); });
+        }
+        // the jobs refer to this frame, wait for all of them even if one throws
+        std::exception_ptr error;
+        try {
+            if (n_threads > 0) {
+                tokenize_subtasks(0);
+            }
+        } catch (...) {
+            error = std::current_exception();
+        }
+        for (std::future<void> &worker : workers) {
+            worker.wait();
+        }
+        if (error != nullptr) {
+            std::rethrow_exception(error);
+        }
+        for (std::future<void> &worker : workers) {
+            worker.get();
+        }
+        for (server_task &subtask : subtasks) {
+            queue_tasks.post(std::move(subtask));
+        }
+    }
+
+    // estimate the tokens a completion task costs, i.e. the prompt length plus n_predict
+    int32_t estimate_task_cost(const server_task &task) const {
+        int32_t n_prompt = 0;
+        if (task.tokenized) {
+            n_prompt = int32_t(task.prompt_tokens.size());
+        } else if (task.data.contains("prompt")) {
+            const json &prompt = task.data.at("prompt");
+            if (prompt.is_string() || prompt.is_array()) {
+                n_prompt = int32_t(tokenize(prompt, false).size());
+            }
+        }
+        int32_t n_predict = json_value(task.data, "n_predict", params.n_predict);
+        if (n_predict < 0) {
+            n_predict = slots.front().n_ctx;
+        }
+        return n_prompt + n_predict;
+    }
+
+    void defer_completion_task(server_task &task) {
+        if (queue_tasks.sched_policy == SERVER_SCHED_POLICY_SJF && task.n_cost < 0) {
+            task.n_cost = estimate_task_cost(task);
         }
+        queue_tasks.defer(std::move(task));
     }
 
-    void process_single_task(const server_task &task) {
+    void process_single_task(server_task &task) {
         switch (task.type) {
         case SERVER_TASK_TYPE_COMPLETION: {
             const int id_slot = json_value(task.data, "id_slot", -1);
@@ -1778,24 +3356,19 @@ struct server_context {
             if (id_slot != -1) {
                 slot = get_slot_by_id(id_slot);
             } else {
-                std::string prompt;
-                if (task.data.contains("prompt") && task.data.at("prompt").is_string()) {
-                    prompt = json_value(task.data, "prompt", std::string());
-                }
-
-                slot = get_available_slot(prompt);
+                slot = get_available_slot(task);
             }
 
             if (slot == nullptr) {
                 // if no slot is available, we defer this task for
                 // processing later
-                queue_tasks.defer(task);
+                defer_completion_task(task);
                 break;
             }
             if (!slot->available()) {
                 // if requested slot is unavailable, we defer this task for
                 // processing later
-                queue_tasks.defer(task);
+                defer_completion_task(task);
                 break;
             }
 
@@ -1805,6 +3378,7 @@ struct server_context {
             slot->id_multi = task.id_multi;
             slot->infill = task.infill;
             slot->embedding = task.embedding;
+            slot->priority = task.priority;
 
             if (!launch_slot_with_task(*slot, task)) {
                 LOG_ERROR("error while launching slot", task.data);
@@ -1820,9 +3394,6 @@ struct server_context {
                 }
             }
         } break;
-        case SERVER_TASK_TYPE_NEXT_RESPONSE: {
-            // do nothing
-        } break;
         case SERVER_TASK_TYPE_METRICS: {
             json slots_data = json::array();
 
@@ -1840,6 +3411,20 @@ struct server_context {
                     {"stopped_word", slot.stopped_word},     {"stopped_limit", slot.stopped_limit},
                     {"stopping_word", slot.stopping_word},
                 };
+                if (slot.n_drafted > 0) {
+                    slot_data["speculative"] = {
+                        {"stochastic", slot.draft_stochastic},
+                        {"n_draft", slot.n_draft},
+                        {"accepted_ewma", slot.draft_accepted_ewma},
+                        {"accepted_hist", slot.draft_accepted_hist},
+                        {"n_drafted", slot.n_drafted},
+                        {"n_drafted_accepted", slot.n_drafted_accepted},
+                        {"accepted_p", float(slot.n_drafted_accepted) / float(slot.n_drafted)},
+                        {"n_decode_steps", slot.n_decode_steps},
+                        {"tokens_per_step",
+                         float(slot.n_decoded) / float(std::max(slot.n_decode_steps, 1))},
+                    };
+                }
 
                 if (slot_data["state"] == SLOT_STATE_IDLE) {
                     n_idle_slots++;
@@ -1853,6 +3438,12 @@ struct server_context {
                                    {"n_idle_slots", n_idle_slots},
                                    {"n_processing_slots", n_processing_slots}});
 
+            uint64_t n_tokenize_cache_hits;
+            uint64_t n_tokenize_cache_misses;
+            size_t n_tokenize_cache_tokens;
+            tokens_cache.stats(n_tokenize_cache_hits, n_tokenize_cache_misses,
+                               n_tokenize_cache_tokens);
+
             server_task_result res;
             res.id = task.id;
             res.id_multi = task.id_multi;
@@ -1870,6 +3461,7 @@ struct server_context {
                 {"t_prompt_processing_total", metrics.t_prompt_processing_total},
                 {"n_tokens_drafted_total", metrics.n_tokens_drafted_total},
                 {"n_tokens_drafted_accepted_total", metrics.n_tokens_drafted_accepted_total},
+                {"drafted_accepted_hist", metrics.drafted_accepted_hist},
 
                 {"n_prompt_tokens_processed", metrics.n_prompt_tokens_processed},
                 {"t_prompt_processing", metrics.t_prompt_processing},
@@ -1879,6 +3471,10 @@ struct server_context {
                 {"kv_cache_tokens_count", llama_get_kv_cache_token_count(ctx)},
                 {"kv_cache_used_cells", llama_get_kv_cache_used_cells(ctx)},
 
+                {"tokenize_cache_hits_total", n_tokenize_cache_hits},
+                {"tokenize_cache_misses_total", n_tokenize_cache_misses},
+                {"tokenize_cache_tokens", n_tokenize_cache_tokens},
+
                 {"slots", slots_data},
             };
 
@@ -1897,32 +3493,122 @@ struct server_context {
             if (!slot->available()) {
                 // if requested slot is unavailable, we defer this task for
                 // processing later
-                queue_tasks.defer(task);
+                queue_tasks.defer(std::move(task));
                 break;
             }
 
-            const size_t token_count = slot->cache_tokens.size();
             const int64_t t_start = ggml_time_us();
 
             std::string filename = task.data.at("filename");
             std::string filepath = task.data.at("filepath");
 
-            const size_t nwrite = llama_state_seq_save_file(ctx, filepath.c_str(), slot->id + 1,
-                                                            slot->cache_tokens.data(), token_count);
+            const std::vector<llama_token> &tokens = slot->cache_tokens;
+
+            // only append the tokens after what the file holds already,
+            // unless a save of the file is still to be written
+            bool incremental = false;
+            size_t n_base = 0;
+            if (slot_save_deltas > 0) {
+                std::lock_guard<std::mutex> lock(mutex_slot_saves);
+                auto it = slot_saves.find(filepath);
+                if (it != slot_saves.end() && slot_saves_pending.count(filepath) == 0 &&
+                    it->second.n_deltas < slot_save_deltas &&
+                    it->second.tokens.size() <= tokens.size() &&
+                    std::equal(it->second.tokens.begin(), it->second.tokens.end(),
+                               tokens.begin())) {
+                    incremental = true;
+                    n_base = it->second.tokens.size();
+                }
+            }
 
-            const int64_t t_end = ggml_time_us();
-            const double t_save_ms = double(t_end - t_start) / 1000.0;
+            // stage the state, the I/O thread writes it out
+            std::shared_ptr<server_slot_snapshot> snapshot(new server_slot_snapshot);
+            snapshot->tokens = tokens;
+            bool staged = true;
+            if (!incremental) {
+                snapshot->data.resize(llama_state_seq_get_size(ctx, slot->id + 1));
+                staged = llama_state_seq_get_data(ctx, snapshot->data.data(),
+                                                  snapshot->data.size(),
+                                                  slot->id + 1) == snapshot->data.size();
+            } else if (n_base < tokens.size()) {
+                slot_snapshot_delta delta;
+                delta.p0 = uint32_t(n_base);
+                delta.tokens.assign(tokens.begin() + n_base, tokens.end());
+                const auto n_system_tokens = int32_t(system_tokens.size());
+                staged = stage_kv_range(slot->id + 1, n_system_tokens + int32_t(n_base),
+                                        n_system_tokens + int32_t(tokens.size()), delta.data);
+                snapshot->deltas.push_back(std::move(delta));
+            }
+            if (!staged) {
+                send_error(task, "Unable to save slot, failed to copy the state",
+                           ERROR_TYPE_SERVER);
+                break;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex_slot_saves);
+                slot_saves_pending[filepath]++;
+            }
 
-            server_task_result result;
-            result.id = task.id;
-            result.stop = true;
-            result.error = false;
-            result.data = json{{"id_slot", id_slot},
-                               {"filename", filename},
-                               {"n_saved", token_count}, // tokens saved
-                               {"n_written", nwrite},    // bytes written
-                               {"timings", {{"save_ms", t_save_ms}}}};
-            queue_results.send(result);
+            const double t_stage_ms = double(ggml_time_us() - t_start) / 1000.0;
+
+            const int id_task = task.id;
+            const int id_multi = task.id_multi;
+            io_worker.post([this, id_task, id_multi, id_slot, filename, filepath, snapshot,
+                            incremental, t_start, t_stage_ms]() {
+                size_t nwrite = 0;
+                bool ok = true;
+                if (incremental) {
+                    for (const slot_snapshot_delta &delta : snapshot->deltas) {
+                        const size_t n =
+                            slot_snapshot_append_delta(filepath, delta, slot_save_quant);
+                        ok = ok && n > 0;
+                        nwrite += n;
+                    }
+                } else {
+                    nwrite = slot_snapshot_write(filepath, snapshot->tokens, snapshot->data,
+                                                 slot_save_quant, model_fingerprint);
+                    ok = nwrite > 0;
+                    // compacted, the deltas are in the base now
+                    std::remove(slot_snapshot_delta_path(filepath).c_str());
+                }
+                {
+                    // record what the file holds once written, a failed write leaves it unknown
+                    std::lock_guard<std::mutex> lock(mutex_slot_saves);
+                    if (!ok) {
+                        slot_saves.erase(filepath);
+                    } else {
+                        server_slot_save_record &record = slot_saves[filepath];
+                        record.tokens = snapshot->tokens;
+                        record.n_deltas = incremental
+                                              ? record.n_deltas + int32_t(snapshot->deltas.size())
+                                              : 0;
+                    }
+                    auto it = slot_saves_pending.find(filepath);
+                    if (--it->second == 0) {
+                        slot_saves_pending.erase(it);
+                    }
+                }
+                if (!ok) {
+                    send_error(id_task, id_multi, "Unable to save slot, failed to write file",
+                               ERROR_TYPE_SERVER);
+                    return;
+                }
+
+                const int64_t t_end = ggml_time_us();
+                const double t_save_ms = double(t_end - t_start) / 1000.0;
+
+                server_task_result result;
+                result.id = id_task;
+                result.stop = true;
+                result.error = false;
+                result.data = json{{"id_slot", id_slot},
+                                   {"filename", filename},
+                                   {"n_saved", snapshot->tokens.size()}, // tokens saved
+                                   {"n_written", nwrite},                // bytes written
+                                   {"incremental", incremental},
+                                   {"timings", {{"save_ms", t_save_ms}, {"stage_ms", t_stage_ms}}}};
+                queue_results.send(result);
+            });
         } break;
         case SERVER_TASK_TYPE_SLOT_RESTORE: {
             int id_slot = task.data.at("id_slot");
@@ -1931,36 +3617,89 @@ struct server_context {
                 send_error(task, "Invalid slot ID", ERROR_TYPE_INVALID_REQUEST);
                 break;
             }
+
+            std::string filename = task.data.at("filename");
+            std::string filepath = task.data.at("filepath");
+
+            if (task.snapshot == nullptr) {
+                // read ahead on the I/O thread, then come back with the staged state
+                const int id_task = task.id;
+                const int id_multi = task.id_multi;
+                const size_t n_ctx_slot = slot->n_ctx;
+                const int64_t t_start = ggml_time_us();
+                json data = task.data;
+                io_worker.post([this, id_task, id_multi, n_ctx_slot, filepath, data, t_start]() {
+                    std::shared_ptr<server_slot_snapshot> snapshot(new server_slot_snapshot);
+                    size_t nread = slot_snapshot_read(filepath, n_ctx_slot, model_fingerprint,
+                                                      snapshot->tokens, snapshot->data);
+                    if (nread == 0) {
+                        send_error(id_task, id_multi,
+                                   "Unable to restore slot, invalid slot save file",
+                                   ERROR_TYPE_INVALID_REQUEST);
+                        return;
+                    }
+                    nread += slot_snapshot_read_deltas(filepath, snapshot->tokens.size(),
+                                                       n_ctx_slot, snapshot->deltas);
+
+                    server_task staged;
+                    staged.id = id_task;
+                    staged.id_multi = id_multi;
+                    staged.type = SERVER_TASK_TYPE_SLOT_RESTORE;
+                    staged.data = data;
+                    staged.data["n_read"] = nread;
+                    staged.data["t_start"] = t_start;
+                    staged.snapshot = snapshot;
+                    queue_tasks.post(std::move(staged));
+                });
+                break;
+            }
             if (!slot->available()) {
                 // if requested slot is unavailable, we defer this task for
                 // processing later
-                queue_tasks.defer(task);
+                queue_tasks.defer(std::move(task));
                 break;
             }
 
-            const int64_t t_start = ggml_time_us();
+            const int64_t t_stage = ggml_time_us();
 
-            std::string filename = task.data.at("filename");
-            std::string filepath = task.data.at("filepath");
-
-            slot->cache_tokens.resize(slot->n_ctx);
-            size_t token_count = 0;
-            size_t nread = llama_state_seq_load_file(ctx, filepath.c_str(), slot->id + 1,
-                                                     slot->cache_tokens.data(),
-                                                     slot->cache_tokens.size(), &token_count);
-            if (nread == 0) {
-                slot->cache_tokens.resize(0);
-                send_error(task,
-                           "Unable to restore slot, no available space in KV "
-                           "cache or invalid slot "
-                           "save file",
+            const server_slot_snapshot &snapshot = *task.snapshot;
+            if (llama_state_seq_set_data(ctx, snapshot.data.data(), snapshot.data.size(),
+                                         slot->id + 1) == 0) {
+                slot->cache_tokens.clear();
+                prefix_cache.erase(slot->id + 1);
+                send_error(task, "Unable to restore slot, no available space in KV cache",
                            ERROR_TYPE_INVALID_REQUEST);
                 break;
             }
-            slot->cache_tokens.resize(token_count);
+            slot->cache_tokens = snapshot.tokens;
+            // replay the deltas through the scratch sequence
+            size_t n_deltas = 0;
+            for (const slot_snapshot_delta &delta : snapshot.deltas) {
+                llama_kv_cache_seq_rm(ctx, seq_scratch, -1, -1);
+                if (llama_state_seq_set_data(ctx, delta.data.data(), delta.data.size(),
+                                             seq_scratch) == 0) {
+                    break;
+                }
+                llama_kv_cache_seq_cp(ctx, seq_scratch, slot->id + 1, -1, -1);
+                llama_kv_cache_seq_rm(ctx, seq_scratch, -1, -1);
+                slot->cache_tokens.insert(slot->cache_tokens.end(), delta.tokens.begin(),
+                                          delta.tokens.end());
+                n_deltas++;
+            }
+            prefix_cache.insert(slot->id + 1, slot->cache_tokens);
+            {
+                // a partially replayed file is compacted by the next save
+                std::lock_guard<std::mutex> lock(mutex_slot_saves);
+                server_slot_save_record &record = slot_saves[filepath];
+                record.tokens = slot->cache_tokens;
+                record.n_deltas = n_deltas == snapshot.deltas.size() ? int32_t(n_deltas)
+                                                                     : slot_save_deltas;
+            }
 
             const int64_t t_end = ggml_time_us();
+            const int64_t t_start = task.data.at("t_start");
             const double t_restore_ms = double(t_end - t_start) / 1000.0;
+            const double t_stage_ms = double(t_end - t_stage) / 1000.0;
 
             server_task_result result;
             result.id = task.id;
@@ -1968,9 +3707,11 @@ struct server_context {
             result.error = false;
             result.data = json{{"id_slot", id_slot},
                                {"filename", filename},
-                               {"n_restored", token_count}, // tokens restored
-                               {"n_read", nread},           // bytes read
-                               {"timings", {{"restore_ms", t_restore_ms}}}};
+                               {"n_restored", slot->cache_tokens.size()}, // tokens restored
+                               {"n_read", task.data.at("n_read")},        // bytes read
+                               {"n_deltas", n_deltas},
+                               {"timings",
+                                {{"restore_ms", t_restore_ms}, {"stage_ms", t_stage_ms}}}};
             queue_results.send(result);
         } break;
         case SERVER_TASK_TYPE_SLOT_ERASE: {
@@ -1983,12 +3724,13 @@ struct server_context {
             if (!slot->available()) {
                 // if requested slot is unavailable, we defer this task for
                 // processing later
-                queue_tasks.defer(task);
+                queue_tasks.defer(std::move(task));
                 break;
             }
 
             // Erase token cache
             const size_t n_erased = slot->cache_tokens.size();
+            prefix_cache.erase(slot->id + 1);
             llama_kv_cache_seq_rm(ctx, slot->id + 1, -1, -1);
             if (ctx_draft != nullptr) {
                 llama_kv_cache_seq_rm(ctx_draft, slot->id + 1, -1, -1);
@@ -2010,25 +3752,809 @@ struct server_context {
             result.data = json{{"success", true}};
             queue_results.send(result);
         } break;
+        case SERVER_TASK_TYPE_PREFIX_ADD: {
+            const std::string id_prefix = task.data.at("id_prefix");
+            const int64_t t_start = ggml_time_us();
+
+            // replace the existing one
+            auto it = named_prefixes.find(id_prefix);
+            if (it != named_prefixes.end()) {
+                evict_named_prefix(it->second);
+                named_prefixes.erase(it);
+            }
+
+            server_named_prefix prefix;
+            prefix.tokens = tokenize(task.data.at("prompt"), system_prompt.empty());
+            if (prefix.tokens.empty()) {
+                send_error(task, "\"prompt\" must not be empty", ERROR_TYPE_INVALID_REQUEST);
+                break;
+            }
+            it = named_prefixes.emplace(id_prefix, std::move(prefix)).first;
+            if (!prefill_named_prefix(it->first, it->second)) {
+                named_prefixes.erase(it);
+                send_error(task,
+                           "Unable to prefill prefix, it exceeds the reserved KV cache or no "
+                           "available space in KV cache",
+                           ERROR_TYPE_INVALID_REQUEST);
+                break;
+            }
+
+            const int64_t t_end = ggml_time_us();
+            const double t_prefill_ms = double(t_end - t_start) / 1000.0;
+
+            server_task_result result;
+            result.id = task.id;
+            result.stop = true;
+            result.error = false;
+            result.data = json{{"id_prefix", id_prefix},
+                               {"n_tokens", it->second.tokens.size()},
+                               {"timings", {{"prefill_ms", t_prefill_ms}}}};
+            queue_results.send(result);
+        } break;
+        case SERVER_TASK_TYPE_PREFIX_LIST: {
+            json prefixes = json::array();
+            for (const auto &it : named_prefixes) {
+                prefixes.push_back(json{{"id_prefix", it.first},
+                                        {"n_tokens", it.second.tokens.size()},
+                                        {"resident", it.second.seq_id >= 0}});
+            }
+
+            server_task_result result;
+            result.id = task.id;
+            result.stop = true;
+            result.error = false;
+            result.data = json{{"prefixes", prefixes}};
+            queue_results.send(result);
+        } break;
+        case SERVER_TASK_TYPE_PREFIX_DELETE: {
+            const std::string id_prefix = task.data.at("id_prefix");
+            auto it = named_prefixes.find(id_prefix);
+            if (it == named_prefixes.end()) {
+                send_error(task, "Unknown prefix ID", ERROR_TYPE_NOT_FOUND);
+                break;
+            }
+            const size_t n_erased = it->second.tokens.size();
+            evict_named_prefix(it->second);
+            named_prefixes.erase(it);
+
+            server_task_result result;
+            result.id = task.id;
+            result.stop = true;
+            result.error = false;
+            result.data = json{{"id_prefix", id_prefix}, {"n_erased", n_erased}};
+            queue_results.send(result);
+        } break;
+        case SERVER_TASK_TYPE_SLOT_FINISH: {
+            // the output thread is done with the text of the slot
+            server_slot *slot = get_slot_by_id(task.data.at("id_slot"));
+            if (slot == nullptr || slot->id_task != task.data.at("id_task") ||
+                slot->state != SLOT_STATE_PROCESSING || slot->command == SLOT_COMMAND_RELEASE) {
+                break;
+            }
+            if (task.data.at("stopped_word")) {
+                slot->stopped_word = true;
+                slot->stopping_word = task.data.at("stopping_word");
+                slot->has_next_token = false;
+            }
+            slot->finishing = false;
+            slot->release();
+            send_final_response(*slot);
+            metrics.on_prediction(*slot);
+            load.on_prediction(*slot);
+        } break;
+        case SERVER_TASK_TYPE_PREFIX_READ: {
+            // a spilled prefix is read ahead, the slots waiting for it start over
+            const uint64_t hash = task.data.at("hash");
+            prefix_store.on_read(hash, *task.snapshot);
+            for (server_slot &slot : slots) {
+                if (slot.prefix_pending == hash) {
+                    slot.prefix_pending = 0;
+                }
+            }
+        } break;
+        }
+    }
+
+    void on_finish_multitask(const server_task_multi &multitask) {
+        // all subtasks done == multitask is done
+        server_task_result result;
+        result.id = multitask.id;
+        result.stop = true;
+        result.error = false;
+
+        // collect json results into one json result
+        std::vector<json> result_jsons;
+        for (const auto &subres : multitask.results) {
+            result_jsons.push_back(subres.data);
+            result.error = result.error && subres.error;
+        }
+        result.data = json{{"results", result_jsons}};
+
+        queue_results.send(result);
+    }
+
+    // park the prefix cached by the idle slot before it is overwritten beyond n_keep tokens,
+    // the least recently used parked sequence is evicted if there is no free one
+    void park_prefix(const server_slot &slot, size_t n_keep) {
+        const llama_seq_id seq_id = slot.id + 1;
+        if (n_parked <= 0 || !prefix_cache.contains(seq_id)) {
+            return;
+        }
+        const std::vector<llama_token> &tokens = prefix_cache.get(seq_id);
+        if (tokens.size() <= n_keep) {
+            return;
+        }
+        // skip if another sequence holds it already
+        const auto hit = prefix_cache.longest_prefix(
+            tokens, [seq_id](int32_t owner) { return owner != seq_id; });
+        if (hit.second == tokens.size()) {
+            return;
+        }
+
+        int32_t i_parked = 0;
+        for (int32_t i = 1; i < n_parked; i++) {
+            if (t_parked_last_used[i] < t_parked_last_used[i_parked]) {
+                i_parked = i;
+            }
+        }
+        const llama_seq_id parked_seq_id = params.n_parallel + 1 + i_parked;
+        spill_prefix(parked_seq_id, 0);
+        llama_kv_cache_seq_rm(ctx, parked_seq_id, -1, -1);
+        llama_kv_cache_seq_cp(ctx, seq_id, parked_seq_id, -1, -1);
+        if (ctx_draft != nullptr) {
+            llama_kv_cache_seq_rm(ctx_draft, parked_seq_id, -1, -1);
+            llama_kv_cache_seq_cp(ctx_draft, seq_id, parked_seq_id, -1, -1);
+        }
+        prefix_cache.insert(parked_seq_id, tokens);
+        t_parked_last_used[i_parked] = ggml_time_us();
+
+        LOG_INFO("park slot prefix", {{"id_slot", slot.id},
+                                      {"id_parked", i_parked},
+                                      {"n_tokens", tokens.size()}});
+    }
+
+    // spill the KV state of the prefix cached by the sequence to the host tiers before it is
+    // overwritten beyond n_keep tokens
+    void spill_prefix(llama_seq_id seq_id, size_t n_keep) {
+        if (!prefix_store.enabled() || !prefix_cache.contains(seq_id)) {
+            return;
+        }
+        prefix_store.collect();
+        const std::vector<llama_token> &prefix = prefix_cache.get(seq_id);
+        if (prefix.size() <= n_keep) {
+            return;
+        }
+        // the sequence holds the system prompt as well
+        std::vector<llama_token> tokens(system_tokens);
+        tokens.insert(tokens.end(), prefix.begin(), prefix.end());
+        if (prefix_store.contains(snapshot_hash(tokens))) {
+            return;
+        }
+
+        const int64_t t_start = ggml_time_us();
+        std::vector<uint8_t> data(llama_state_seq_get_size(ctx, seq_id));
+        if (data.empty() || llama_state_seq_get_data(ctx, data.data(), data.size(), seq_id) == 0) {
+            return;
+        }
+        const size_t n_bytes = data.size();
+        if (!prefix_store.put(tokens, std::move(data))) {
+            return;
+        }
+
+        LOG_INFO("spill prefix", {{"seq_id", seq_id},
+                                  {"n_tokens", prefix.size()},
+                                  {"n_bytes", n_bytes},
+                                  {"t_ms", double(ggml_time_us() - t_start) / 1e3},
+                                  {"ram_used", prefix_store.ram_used},
+                                  {"disk_used", prefix_store.disk_used}});
+    }
+
+    // restore the longest prefix of the prompt spilled to the host tiers, returns the new n_past,
+    // a prefix on disk only is read ahead on the I/O thread while the slot waits for it
+    int32_t restore_prefix(server_slot &slot, const std::vector<llama_token> &prompt_tokens,
+                           int32_t n_past) {
+        if (!prefix_store.enabled()) {
+            return n_past;
+        }
+        prefix_store.collect();
+        std::vector<llama_token> tokens(system_tokens);
+        tokens.insert(tokens.end(), prompt_tokens.begin(), prompt_tokens.end());
+        const auto hit = prefix_store.find(tokens);
+        const auto n_system_tokens = int32_t(system_tokens.size());
+        const int32_t n_hit = int32_t(hit.second) - n_system_tokens;
+        if (n_hit <= n_past) {
+            return n_past;
+        }
+        if (elastic_ctx && !reserve_kv_cells(slot, n_hit)) {
+            return n_past;
+        }
+
+        const int64_t t_start = ggml_time_us();
+        std::vector<uint8_t> data;
+        if (!prefix_store.get(hit.first, data)) {
+            const uint64_t hash = hit.first;
+            const auto done = [this, hash](std::shared_ptr<server_slot_snapshot> snapshot) {
+                server_task task;
+                task.type = SERVER_TASK_TYPE_PREFIX_READ;
+                task.data = {{"hash", hash}};
+                task.snapshot = snapshot;
+                queue_tasks.post(std::move(task));
+            };
+            if (prefix_store.read_ahead(hash, done)) {
+                slot.prefix_pending = hash;
+            }
+            return n_past;
+        }
+        const llama_seq_id seq_id = slot.id + 1;
+        llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+        if (llama_state_seq_set_data(ctx, data.data(), data.size(), seq_id) == 0) {
+            // the sequence is gone, take the system prompt back
+            llama_kv_cache_seq_cp(ctx, 0, seq_id, -1, -1);
+            slot.cache_tokens.clear();
+            return 0;
+        }
+        slot.cache_tokens.assign(prompt_tokens.begin(), prompt_tokens.begin() + n_hit);
+
+        const double t_ms = double(ggml_time_us() - t_start) / 1e3;
+        LOG_INFO("slot restores spilled prefix", {{"id_slot", slot.id},
+                                                  {"id_task", slot.id_task},
+                                                  {"n_past_old", n_past},
+                                                  {"n_past", n_hit},
+                                                  {"t_ms", t_ms}});
+        return n_hit;
+    }
+
+    // evict the least recently used parked sequence, returns the freed KV cells
+    int32_t evict_parked_prefix() {
+        int32_t i_parked = -1;
+        for (int32_t i = 0; i < n_parked; i++) {
+            const llama_seq_id parked_seq_id = params.n_parallel + 1 + i;
+            if (!prefix_cache.contains(parked_seq_id)) {
+                continue;
+            }
+            if (i_parked == -1 || t_parked_last_used[i] < t_parked_last_used[i_parked]) {
+                i_parked = i;
+            }
+        }
+        if (i_parked == -1) {
+            return 0;
+        }
+
+        const llama_seq_id parked_seq_id = params.n_parallel + 1 + i_parked;
+        const auto n_cells = int32_t(prefix_cache.get(parked_seq_id).size());
+        spill_prefix(parked_seq_id, 0);
+        llama_kv_cache_seq_rm(ctx, parked_seq_id, -1, -1);
+        if (ctx_draft != nullptr) {
+            llama_kv_cache_seq_rm(ctx_draft, parked_seq_id, -1, -1);
+        }
+        prefix_cache.erase(parked_seq_id);
+        t_parked_last_used[i_parked] = -1;
+
+        LOG_INFO("evict parked prefix", {{"id_parked", i_parked}, {"n_tokens", n_cells}});
+        return n_cells;
+    }
+
+    // reuse the longest prefix of the prompt cached by another sequence, returns the new n_past
+    int32_t reuse_prefix(server_slot &slot, const std::vector<llama_token> &prompt_tokens,
+                         int32_t n_past) {
+        const llama_seq_id seq_id = slot.id + 1;
+        const auto hit = prefix_cache.longest_prefix(
+            prompt_tokens, [seq_id](int32_t owner) { return owner != seq_id; });
+        if (hit.first < 0 || int32_t(hit.second) <= n_past) {
+            return n_past;
+        }
+
+        const auto n_system_tokens = int32_t(system_tokens.size());
+        const auto n_hit = int32_t(hit.second);
+        if (!llama_kv_cache_seq_rm(ctx, seq_id, n_system_tokens, -1)) {
+            // could not partially delete (likely using a non-Transformer model)
+            return n_past;
+        }
+        llama_kv_cache_seq_cp(ctx, hit.first, seq_id, n_system_tokens, n_system_tokens + n_hit);
+        if (ctx_draft != nullptr) {
+            llama_kv_cache_seq_rm(ctx_draft, seq_id, n_system_tokens, -1);
+            llama_kv_cache_seq_cp(ctx_draft, hit.first, seq_id, n_system_tokens,
+                                  n_system_tokens + n_hit);
+        }
+        slot.cache_tokens.assign(prompt_tokens.begin(), prompt_tokens.begin() + n_hit);
+        const int32_t i_reserved = hit.first - params.n_parallel - 1;
+        if (i_reserved >= n_parked) {
+            named_prefixes[named_prefix_seqs[i_reserved - n_parked]].t_last_used = ggml_time_us();
+        } else if (i_reserved >= 0) {
+            t_parked_last_used[i_reserved] = ggml_time_us();
+        }
+
+        LOG_INFO("slot reuses cached prefix", {{"id_slot", slot.id},
+                                               {"id_task", slot.id_task},
+                                               {"from_seq", hit.first},
+                                               {"n_past_old", n_past},
+                                               {"n_past", n_hit}});
+        return n_hit;
+    }
+
+    // copy the KV cells of the sequence in [p0, p1) out through the scratch sequence
+    bool stage_kv_range(llama_seq_id seq_id, llama_pos p0, llama_pos p1,
+                        std::vector<uint8_t> &data) {
+        llama_kv_cache_seq_rm(ctx, seq_scratch, -1, -1);
+        llama_kv_cache_seq_cp(ctx, seq_id, seq_scratch, p0, p1);
+        data.resize(llama_state_seq_get_size(ctx, seq_scratch));
+        const bool ok =
+            llama_state_seq_get_data(ctx, data.data(), data.size(), seq_scratch) == data.size();
+        llama_kv_cache_seq_rm(ctx, seq_scratch, -1, -1);
+        return ok;
+    }
+
+    // evict the named prefix from its reserved sequence, it stays registered
+    void evict_named_prefix(server_named_prefix &prefix) {
+        if (prefix.seq_id < 0) {
+            return;
+        }
+        llama_kv_cache_seq_rm(ctx, prefix.seq_id, -1, -1);
+        if (ctx_draft != nullptr) {
+            llama_kv_cache_seq_rm(ctx_draft, prefix.seq_id, -1, -1);
+        }
+        prefix_cache.erase(prefix.seq_id);
+        named_prefix_seqs[prefix.seq_id - params.n_parallel - 1 - n_parked].clear();
+        prefix.seq_id = -1;
+    }
+
+    // find a reserved sequence with room for the tokens of a named prefix, the least recently
+    // used named prefixes are evicted if there is none, returns its index or -1
+    int32_t reserve_named_seq(int32_t n_tokens) {
+        if (n_tokens > n_named_ctx) {
+            return -1;
+        }
+        int32_t i_named = -1;
+        while (true) {
+            int32_t n_used = 0;
+            server_named_prefix *lru = nullptr;
+            for (auto &it : named_prefixes) {
+                if (it.second.seq_id < 0) {
+                    continue;
+                }
+                n_used += int32_t(it.second.tokens.size());
+                if (lru == nullptr || it.second.t_last_used < lru->t_last_used) {
+                    lru = &it.second;
+                }
+            }
+            i_named = -1;
+            for (int32_t i = 0; i < n_named; i++) {
+                if (named_prefix_seqs[i].empty()) {
+                    i_named = i;
+                    break;
+                }
+            }
+            if (i_named >= 0 && n_used + n_tokens <= n_named_ctx) {
+                return i_named;
+            }
+            if (lru == nullptr) {
+                return -1;
+            }
+            evict_named_prefix(*lru);
+        }
+    }
+
+    // prefill the named prefix into a reserved sequence
+    bool prefill_named_prefix(const std::string &id, server_named_prefix &prefix) {
+        const auto n_tokens = int32_t(prefix.tokens.size());
+        const int32_t i_named = reserve_named_seq(n_tokens);
+        if (i_named < 0) {
+            return false;
+        }
+
+        const llama_seq_id seq_id = params.n_parallel + 1 + n_parked + i_named;
+        const auto n_system_tokens = int32_t(system_tokens.size());
+        llama_kv_cache_seq_cp(ctx, 0, seq_id, -1, -1);
+        if (ctx_draft != nullptr) {
+            llama_kv_cache_seq_cp(ctx_draft, 0, seq_id, -1, -1);
+        }
+        const auto n_batch = int32_t(llama_n_batch(ctx));
+        for (int32_t i = 0; i < n_tokens; i += n_batch) {
+            llama_batch_clear(batch);
+            const int32_t n_eval = std::min(n_batch, n_tokens - i);
+            for (int32_t j = 0; j < n_eval; j++) {
+                llama_batch_add(batch, prefix.tokens[i + j], n_system_tokens + i + j, {seq_id},
+                                false);
+            }
+            if (llama_decode(ctx, batch) != 0 ||
+                (ctx_draft != nullptr && llama_decode(ctx_draft, batch) != 0)) {
+                llama_batch_clear(batch);
+                llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+                if (ctx_draft != nullptr) {
+                    llama_kv_cache_seq_rm(ctx_draft, seq_id, -1, -1);
+                }
+                return false;
+            }
+        }
+        llama_batch_clear(batch);
+
+        named_prefix_seqs[i_named] = id;
+        prefix.seq_id = seq_id;
+        prefix.t_last_used = ggml_time_us();
+        prefix_cache.insert(seq_id, prefix.tokens);
+        return true;
+    }
+
+    // take the evicted named prefix back to a reserved sequence from the slot that prefilled it
+    // with its prompt, the KV cells are shared rather than decoded once more
+    void adopt_named_prefix(server_slot &slot) {
+        auto it = named_prefixes.find(slot.named_prefix_pending);
+        slot.named_prefix_pending.clear();
+        if (it == named_prefixes.end() || it->second.seq_id >= 0) {
+            return;
+        }
+        server_named_prefix &prefix = it->second;
+        const auto n_tokens = int32_t(prefix.tokens.size());
+        if (slot.cache_tokens.size() < prefix.tokens.size() ||
+            !std::equal(prefix.tokens.begin(), prefix.tokens.end(), slot.cache_tokens.begin())) {
+            // truncated or not cached
+            return;
+        }
+        const int32_t i_named = reserve_named_seq(n_tokens);
+        if (i_named < 0) {
+            return;
+        }
+
+        const llama_seq_id seq_id = params.n_parallel + 1 + n_parked + i_named;
+        const auto p1 = llama_pos(system_tokens.size()) + n_tokens;
+        llama_kv_cache_seq_cp(ctx, slot.id + 1, seq_id, -1, p1);
+        if (ctx_draft != nullptr) {
+            llama_kv_cache_seq_cp(ctx_draft, slot.id + 1, seq_id, -1, p1);
+        }
+
+        named_prefix_seqs[i_named] = it->first;
+        prefix.seq_id = seq_id;
+        prefix.t_last_used = ggml_time_us();
+        prefix_cache.insert(seq_id, prefix.tokens);
+    }
+
+    // the KV cells held by the slot, a slot loading the prompt holds the whole prompt
+    static int32_t get_slot_kv_cells(const server_slot &slot) {
+        if (slot.swapped) {
+            return 0;
+        }
+        int32_t n_cells = slot.n_past + slot.n_drafted_accepted;
+        if (slot.command == SLOT_COMMAND_LOAD_PROMPT && slot.n_prompt_tokens_processed > 0) {
+            n_cells = std::max(n_cells, slot.n_prompt_tokens + 1);
+        }
+        return n_cells;
+    }
+
+    // the KV cells not held by any other slot
+    int32_t get_free_kv_cells(const server_slot &slot) const {
+        int32_t n_free = n_ctx - int32_t(system_tokens.size());
+        for (const server_slot &other : slots) {
+            if (other.id != slot.id) {
+                n_free -= get_slot_kv_cells(other);
+            }
+        }
+        for (int32_t i = 0; i < n_parked; i++) {
+            n_free -= int32_t(prefix_cache.get(params.n_parallel + 1 + i).size());
+        }
+        return n_free - get_slot_kv_cells(slot);
+    }
+
+    // make sure the slot can hold n_cells in total,
+    // evict the KV cache of the least recently used idle slots if needed
+    bool reserve_kv_cells(const server_slot &slot, int32_t n_cells) {
+        int32_t n_needed = n_cells - get_slot_kv_cells(slot);
+        int32_t n_free = get_free_kv_cells(slot);
+        while (n_free < n_needed) {
+            // parked prefixes go first
+            const int32_t n_evicted = evict_parked_prefix();
+            if (n_evicted > 0) {
+                n_free += n_evicted;
+                continue;
+            }
+
+            server_slot *lru = nullptr;
+            for (server_slot &other : slots) {
+                if (other.id == slot.id || !other.available() || get_slot_kv_cells(other) == 0) {
+                    continue;
+                }
+                if (lru == nullptr || other.t_last_used < lru->t_last_used) {
+                    lru = &other;
+                }
+            }
+            if (lru == nullptr) {
+                return false;
+            }
+
+            LOG_INFO("evict slot kv cache", {{"id_slot", lru->id}, {"n_cells", lru->n_past}});
+
+            n_free += get_slot_kv_cells(*lru);
+            spill_prefix(lru->id + 1, 0);
+            const auto n_system_tokens = int32_t(system_tokens.size());
+            llama_kv_cache_seq_rm(ctx, lru->id + 1, n_system_tokens, -1);
+            if (ctx_draft != nullptr) {
+                llama_kv_cache_seq_rm(ctx_draft, lru->id + 1, n_system_tokens, -1);
+            }
+            prefix_cache.erase(lru->id + 1);
+            lru->cache_tokens.clear();
+            lru->n_past = 0;
+            lru->n_drafted_accepted = 0;
+        }
+        return true;
+    }
+
+    llama_seq_id seq_draft_branch(const server_slot &slot, size_t b) const {
+        return seq_scratch + 1 + slot.id * n_draft_tree + llama_seq_id(b);
+    }
+
+    bool is_draft_branch_of(const server_slot &slot, llama_seq_id seq_id) const {
+        return seq_id > seq_scratch && (seq_id - seq_scratch - 1) / n_draft_tree == slot.id;
+    }
+
+    // free the cells of the alternatives to the drafts of the last round
+    void clear_draft_branches(server_slot &slot) {
+        for (size_t b = 0; b < slot.draft_branches.size(); b++) {
+            llama_kv_cache_seq_rm(ctx, seq_draft_branch(slot, b), -1, -1);
+        }
+        slot.draft_branches.clear();
+    }
+
+    // the target sampled the b-th alternative, at pos, instead of the draft token there,
+    // keep its cell in place of the rejected drafts
+    void take_draft_branch(server_slot &slot, size_t b, llama_pos pos) {
+        llama_kv_cache_seq_rm(ctx, slot.id + 1, pos, -1);
+        llama_kv_cache_seq_cp(ctx, seq_draft_branch(slot, b), slot.id + 1, pos, pos + 1);
+        if (ctx_draft != nullptr) {
+            llama_kv_cache_seq_rm(ctx_draft, slot.id + 1, pos, -1);
+            if (slot.n_past_draft > pos) {
+                slot.n_past_draft = pos;
+            }
+        }
+    }
+
+    // swap the sequence of the slot out to host memory and free its KV cells
+    bool swap_out_slot(server_slot &slot) {
+        const llama_seq_id seq_id = slot.id + 1;
+
+        slot.swap_data.resize(llama_state_seq_get_size(ctx, seq_id));
+        if (llama_state_seq_get_data(ctx, slot.swap_data.data(), slot.swap_data.size(), seq_id) == 0) {
+            slot.swap_data.clear();
+            return false;
+        }
+        llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+        if (ctx_draft != nullptr) {
+            slot.swap_data_draft.resize(llama_state_seq_get_size(ctx_draft, seq_id));
+            if (llama_state_seq_get_data(ctx_draft, slot.swap_data_draft.data(),
+                                         slot.swap_data_draft.size(), seq_id) == 0) {
+                slot.swap_data_draft.clear();
+            }
+            llama_kv_cache_seq_rm(ctx_draft, seq_id, -1, -1);
+        }
+
+        slot.swapped = true;
+        slot.t_swapped = ggml_time_us();
+
+        LOG_INFO("slot swapped out", {{"id_slot", slot.id},
+                                      {"id_task", slot.id_task},
+                                      {"n_past", slot.n_past},
+                                      {"size", slot.swap_data.size()}});
+        return true;
+    }
+
+    // restore the sequence of the slot from host memory
+    bool swap_in_slot(server_slot &slot) {
+        const llama_seq_id seq_id = slot.id + 1;
+
+        const size_t nread =
+            llama_state_seq_set_data(ctx, slot.swap_data.data(), slot.swap_data.size(), seq_id);
+        if (ctx_draft != nullptr && !slot.swap_data_draft.empty()) {
+            if (llama_state_seq_set_data(ctx_draft, slot.swap_data_draft.data(),
+                                         slot.swap_data_draft.size(), seq_id) == 0) {
+                llama_kv_cache_seq_rm(ctx_draft, seq_id, -1, -1);
+            }
+        }
+
+        LOG_INFO("slot swapped in", {{"id_slot", slot.id},
+                                     {"id_task", slot.id_task},
+                                     {"n_past", slot.n_past},
+                                     {"t_swapped_ms", (ggml_time_us() - slot.t_swapped) / 1e3}});
+
+        slot.swapped = false;
+        slot.swap_data.clear();
+        slot.swap_data.shrink_to_fit();
+        slot.swap_data_draft.clear();
+        slot.swap_data_draft.shrink_to_fit();
+        return nread != 0;
+    }
+
+    // pick a slot to preempt when the KV cache is full while decoding batch[i_batch:],
+    // prefer the lowest priority, then the latest started one
+    server_slot *get_preemptible_slot() {
+        server_slot *victim = nullptr;
+        int32_t n_active = 0;
+        for (server_slot &slot : slots) {
+            if (!slot.is_processing() || slot.swapped || slot.command == SLOT_COMMAND_RELEASE) {
+                continue;
+            }
+            n_active++;
+            if (slot.embedding || slot.ga_n != 1 || slot.oaicompat_completion_chat_vision) {
+                continue;
+            }
+            if (victim == nullptr || slot.priority < victim->priority ||
+                (slot.priority == victim->priority &&
+                 slot.t_start_process_prompt > victim->t_start_process_prompt)) {
+                victim = &slot;
+            }
+        }
+        // preempting the only running slot frees nothing for the others
+        return n_active > 1 ? victim : nullptr;
+    }
+
+    // tokenize the infill prompt, the prefix and the suffix around the middle token
+    std::vector<llama_token> tokenize_infill(const json &input_prefix,
+                                             const json &input_suffix) const {
+        const bool suff_rm_leading_spc =
+            params.input_suffix.find_first_of(' ') != 0 || params.input_suffix.size() <= 1;
+
+        auto prefix_tokens = tokenize(input_prefix, false);
+        auto suffix_tokens = tokenize(input_suffix, false);
+
+        const int space_token = 29871; // TODO: this should not be hardcoded
+        if (suff_rm_leading_spc && !suffix_tokens.empty() && suffix_tokens[0] == space_token) {
+            suffix_tokens.erase(suffix_tokens.begin());
+        }
+
+        prefix_tokens.insert(prefix_tokens.begin(), llama_token_prefix(model));
+        suffix_tokens.insert(suffix_tokens.begin(), llama_token_suffix(model));
+
+        auto embd_inp = params.spm_infill ? suffix_tokens : prefix_tokens;
+        auto embd_end = params.spm_infill ? prefix_tokens : suffix_tokens;
+        if (add_bos_token) {
+            embd_inp.insert(embd_inp.begin(), llama_token_bos(model));
+        }
+        embd_inp.insert(embd_inp.end(), embd_end.begin(), embd_end.end());
+
+        const llama_token middle_token = llama_token_middle(model);
+        if (middle_token >= 0) {
+            embd_inp.push_back(middle_token);
+        }
+
+        if (add_eos_token) {
+            embd_inp.push_back(llama_token_eos(model));
+        }
+
+        return embd_inp;
+    }
+
+    // tokenize the prompt of the slot, following the named prefix or the infill format
+    std::vector<llama_token> tokenize_prompt(server_slot &slot) {
+        if (slot.infill) {
+            return tokenize_infill(slot.params.input_prefix, slot.params.input_suffix);
+        } else if (!slot.prefix_tokens.empty()) {
+            // follow the named prefix, which has BOS already
+            std::vector<llama_token> prompt_tokens = slot.prefix_tokens;
+            const std::vector<llama_token> tokens = tokenize(slot.prompt, false);
+            prompt_tokens.insert(prompt_tokens.end(), tokens.begin(), tokens.end());
+            return prompt_tokens;
+        } else if (!slot.oaicompat_completion_chat_vision) {
+            // add BOS if there isn't system prompt
+            return tokenize(slot.prompt, system_prompt.empty());
+        }
+        return {};
+
+    }
+
+    // run the bookkeeping of the sampled tokens deferred by the pipelined decode,
+    // skip the slots released or reassigned in the meantime
+    void flush_deferred_tokens() {
+        std::vector<server_deferred_token> tokens;
+        tokens.swap(deferred_tokens);
+        for (server_deferred_token &token : tokens) {
+            server_slot &slot = slots[token.id_slot];
+            if (slot.id_task != token.id_task || slot.state != SLOT_STATE_PROCESSING ||
+                slot.command == SLOT_COMMAND_RELEASE) {
+                continue;
+            }
+            if (!process_token(token.result, slot) || slot.finishing) {
+                slot.finishing = false;
+                slot.release();
+                send_final_response(slot);
+                metrics.on_prediction(slot);
+                load.on_prediction(slot);
+            }
+        }
+    }
+
+    // decode on the worker thread, meanwhile flush the deferred tokens and
+    // tokenize the prompts waiting for the next iterations,
+    // neither touches the context, unlike batching the prompt chunks, which edits the KV cache,
+    // or drafting, which needs the tokens sampled from this decode
+    int decode_pipelined(llama_batch batch_view) {
+        auto job = std::make_shared<std::packaged_task<int()>>(
+            [this, batch_view]() { return llama_decode(ctx, batch_view); });
+        std::future<int> ret = job->get_future();
+        decode_worker.post([job]() { (*job)(); });
+
+        flush_deferred_tokens();
+        for (server_slot &slot : slots) {
+            if (slot.state == SLOT_STATE_IDLE && slot.command == SLOT_COMMAND_LOAD_PROMPT &&
+                !slot.swapped && slot.prompt_tokens.empty() && !slot.prompt_staged) {
+                slot.prompt_tokens_staged = tokenize_prompt(slot);
+                slot.prompt_staged = true;
+            }
+        }
+
+        return ret.get();
+    }
+
+    // preempt the slot, its tokens not decoded yet are removed from batch[i_batch:] and
+    // will be added again after swapping in
+    bool preempt_slot(server_slot &slot, int32_t i_batch) {
+        const llama_seq_id seq_id = slot.id + 1;
+
+        // compact the rest of the batch
+        std::vector<int32_t> remap(batch.n_tokens, -1);
+        int32_t n = i_batch;
+        for (int32_t k = 0; k < i_batch; k++) {
+            remap[k] = k;
+        }
+        for (int32_t k = i_batch; k < batch.n_tokens; k++) {
+            if (batch.seq_id[k][0] == seq_id || is_draft_branch_of(slot, batch.seq_id[k][0])) {
+                continue;
+            }
+            if (n != k) {
+                batch.token[n] = batch.token[k];
+                batch.pos[n] = batch.pos[k];
+                batch.n_seq_id[n] = batch.n_seq_id[k];
+                for (int32_t j = 0; j < batch.n_seq_id[k]; j++) {
+                    batch.seq_id[n][j] = batch.seq_id[k][j];
+                }
+                batch.logits[n] = batch.logits[k];
+            }
+            remap[k] = n++;
+        }
+        const int32_t n_removed = batch.n_tokens - n;
+        batch.n_tokens = n;
+        clear_draft_branches(slot);
+        for (server_slot &other : slots) {
+            if (other.id != slot.id && other.i_batch >= 0) {
+                other.i_batch = remap[other.i_batch];
+            }
+        }
+        if (ctx_draft != nullptr) {
+            int32_t n_draft = 0;
+            for (int32_t k = 0; k < batch_draft.n_tokens; k++) {
+                if (batch_draft.seq_id[k][0] == seq_id) {
+                    continue;
+                }
+                if (n_draft != k) {
+                    batch_draft.token[n_draft] = batch_draft.token[k];
+                    batch_draft.pos[n_draft] = batch_draft.pos[k];
+                    batch_draft.n_seq_id[n_draft] = batch_draft.n_seq_id[k];
+                    for (int32_t j = 0; j < batch_draft.n_seq_id[k]; j++) {
+                        batch_draft.seq_id[n_draft][j] = batch_draft.seq_id[k][j];
+                    }
+                    batch_draft.logits[n_draft] = batch_draft.logits[k];
+                }
+                n_draft++;
+            }
+            batch_draft.n_tokens = n_draft;
         }
-    }
-
-    void on_finish_multitask(const server_task_multi &multitask) {
-        // all subtasks done == multitask is done
-        server_task_result result;
-        result.id = multitask.id;
-        result.stop = true;
-        result.error = false;
 
-        // collect json results into one json result
-        std::vector<json> result_jsons;
-        for (const auto &subres : multitask.results) {
-            result_jsons.push_back(subres.data);
-            result.error = result.error && subres.error;
+        // roll the slot back to the tokens held by the KV cache
+        if (slot.state == SLOT_STATE_PROCESSING && slot.n_decoded > 0) {
+            if (slot.i_batch >= i_batch) {
+                slot.n_past -= 1;
+                if (slot.params.cache_prompt) {
+                    slot.cache_tokens.resize(slot.cache_tokens.size() - slot.sampled.size());
+                }
+            }
+        } else if (n_removed > 0) {
+            slot.state = SLOT_STATE_IDLE;
+            slot.command = SLOT_COMMAND_LOAD_PROMPT;
+            slot.n_past -= n_removed;
+            slot.n_prompt_tokens_processed -= n_removed;
+            if (slot.params.cache_prompt) {
+                slot.cache_tokens.resize(slot.n_past);
+            }
         }
-        result.data = json{{"results", result_jsons}};
+        slot.i_batch = -1;
 
-        queue_results.send(result);
+        return swap_out_slot(slot);
     }
 
     void update_slots() {
@@ -2037,9 +4563,36 @@ struct server_context {
         // release slots
         for (auto &slot : slots) {
             if (slot.command == SLOT_COMMAND_RELEASE) {
+                // the output thread is still busy with the text of the slot
+                if (output_worker.pending(slot.id)) {
+                    queue_tasks.update_slots_at(std::chrono::steady_clock::now() +
+                                                std::chrono::milliseconds(1));
+                    continue;
+                }
                 slot.state = SLOT_STATE_IDLE;
                 slot.command = SLOT_COMMAND_NONE;
                 slot.t_last_used = ggml_time_us();
+                clear_draft_branches(slot);
+
+                // the KV cache of a preempted slot is gone
+                if (slot.swapped) {
+                    slot.swapped = false;
+                    slot.swap_data.clear();
+                    slot.swap_data.shrink_to_fit();
+                    slot.swap_data_draft.clear();
+                    slot.swap_data_draft.shrink_to_fit();
+                    slot.cache_tokens.clear();
+                    slot.n_past = 0;
+                }
+
+                // share the cached prompt with the other slots
+                if (slot.params.cache_prompt && !slot.cache_tokens.empty()) {
+                    const size_t n_cached = std::min(slot.cache_tokens.size(), size_t(slot.n_past));
+                    prefix_cache.insert(slot.id + 1,
+                                        std::vector<llama_token>(slot.cache_tokens.begin(),
+                                                                 slot.cache_tokens.begin() +
+                                                                     n_cached));
+                }
 
                 LOG_INFO("slot released", {{"id_slot", slot.id},
                                            {"id_task", slot.id_task},
@@ -2053,6 +4606,52 @@ struct server_context {
             }
         }
 
+        // swap in the preempted slots once the KV cache has room for them,
+        // in the order they were swapped out
+        while (true) {
+            server_slot *swapped = nullptr;
+            int32_t n_active = 0;
+            for (server_slot &slot : slots) {
+                if (slot.command == SLOT_COMMAND_RELEASE) {
+                    continue;
+                }
+                if (!slot.swapped) {
+                    n_active += slot.is_processing() ? 1 : 0;
+                } else if (swapped == nullptr || slot.t_swapped < swapped->t_swapped) {
+                    swapped = &slot;
+                }
+            }
+            if (swapped == nullptr) {
+                break;
+            }
+            const int32_t n_cells = n_system_tokens + swapped->n_past + swapped->n_drafted_accepted;
+            const int32_t n_free = n_ctx - llama_get_kv_cache_used_cells(ctx);
+            if (n_active > 0 && n_free < n_cells + n_active + 1) {
+                break;
+            }
+            if (!swap_in_slot(*swapped)) {
+                swapped->state = SLOT_STATE_PROCESSING;
+                swapped->command = SLOT_COMMAND_NONE;
+                swapped->release();
+                send_error(*swapped, "Failed to restore the preempted slot", ERROR_TYPE_SERVER);
+            }
+        }
+
+        // publish the load for admission control
+        {
+            int32_t n_idle_slots = 0;
+            int64_t n_pending_prompt_tokens = 0;
+            for (const server_slot &slot : slots) {
+                if (slot.state == SLOT_STATE_IDLE && slot.command == SLOT_COMMAND_NONE) {
+                    n_idle_slots++;
+                } else if (slot.command == SLOT_COMMAND_LOAD_PROMPT) {
+                    n_pending_prompt_tokens += std::max(0, slot.n_prompt_tokens - slot.n_past);
+                }
+            }
+            load.n_idle_slots = n_idle_slots;
+            load.n_pending_prompt_tokens = n_pending_prompt_tokens;
+        }
+
         // check if all slots are idle
         {
             bool all_idle = true;
@@ -2065,7 +4664,17 @@ struct server_context {
 
             if (all_idle) {
                 LOG_INFO("all slots are idle", {});
-                if (system_prompt.empty()) {
+                flush_deferred_tokens();
+                // the kv cache is going to be cleared, forget what the slots held,
+                // but park the cached prefixes if possible
+                for (auto &slot : slots) {
+                    spill_prefix(slot.id + 1, 0);
+                    park_prefix(slot, 0);
+                    prefix_cache.erase(slot.id + 1);
+                    slot.cache_tokens.clear();
+                    slot.n_past = 0;
+                }
+                if (system_prompt.empty() && n_parked == 0 && n_named == 0) {
                     llama_kv_cache_clear(ctx);
                     if (ctx_draft != nullptr) {
                         llama_kv_cache_clear(ctx_draft);
@@ -2074,7 +4683,7 @@ struct server_context {
                     for (int32_t i = 0; i <= params.n_parallel; ++i) {
                         llama_kv_cache_seq_rm(ctx, i, n_system_tokens, -1);
                         if (ctx_draft != nullptr) {
-                            llama_kv_cache_seq_rm(ctx, i, n_system_tokens, -1);
+                            llama_kv_cache_seq_rm(ctx_draft, i, n_system_tokens, -1);
                         }
                     }
                 }
@@ -2082,19 +4691,20 @@ struct server_context {
             }
         }
 
-        {
-            server_task task;
-            task.type = SERVER_TASK_TYPE_NEXT_RESPONSE;
-            task.id_target = -1;
-
-            queue_tasks.post(task);
-        }
-
         // apply context-shift if needed
         // TODO: simplify and improve
         for (server_slot &slot : slots) {
+            if (slot.swapped) {
+                continue;
+            }
             if (slot.ga_n == 1) {
-                if (slot.is_processing() && n_system_tokens + slot.n_past >= slot.n_ctx - 1) {
+                // when the context is elastic, the slot must shift as well if the shared KV cache
+                // cannot hold the next tokens, the drafts and their alternatives
+                const bool kv_full = elastic_ctx && slot.is_processing() &&
+                                     !reserve_kv_cells(slot, get_slot_kv_cells(slot) + 1 +
+                                                                 params.n_draft + n_draft_tree);
+                if (slot.is_processing() &&
+                    (kv_full || n_system_tokens + slot.n_past >= slot.n_ctx - 1)) {
                     // Shift context
                     const int n_keep = slot.params.n_keep + add_bos_token;
                     const int n_left = n_system_tokens + slot.n_past - n_keep;
@@ -2143,11 +4753,14 @@ struct server_context {
 
         // first, add sampled tokens from any ongoing sequences
         for (auto &slot : slots) {
-            if (slot.state == SLOT_STATE_IDLE) {
+            if (slot.state == SLOT_STATE_IDLE || slot.command == SLOT_COMMAND_RELEASE ||
+                slot.swapped || slot.finishing) {
                 continue;
             }
 
             if (slot.token_bkt && !slot.token_bkt->acquire()) {
+                // wake up again when the bucket refills
+                queue_tasks.update_slots_at(slot.token_bkt->next_refill());
                 continue;
             }
 
@@ -2156,15 +4769,34 @@ struct server_context {
             int32_t slot_npast = slot.n_past_se > 0 ? slot.n_past_se : slot.n_past;
             slot_npast += slot.n_drafted_accepted;
 
+            // the draft branches see the cells of the slot, and the drafts up to their depth,
+            // the alternative tokens are the last ones of the slot in the batch
+            std::vector<llama_seq_id> seq_ids = {slot.id + 1};
+            for (size_t b = 0; b < slot.draft_branches.size(); b++) {
+                seq_ids.push_back(seq_draft_branch(slot, b));
+                llama_kv_cache_seq_cp(ctx, slot.id + 1, seq_ids.back(), -1, -1);
+            }
+            const llama_pos pos_draft = n_system_tokens + slot_npast + 1;
+
             // TODO: we always have to take into account the "system_tokens"
             //       this is not great and needs to be improved somehow
             llama_batch_add(batch, slot.sampled[slot.sampled.size() - 1],
-                            n_system_tokens + slot_npast, {slot.id + 1}, true);
+                            n_system_tokens + slot_npast, seq_ids, true);
             if (!slot.sampled_draft.empty()) {
-                for (const llama_token &tok : slot.sampled_draft) {
-                    llama_batch_add(batch, tok, n_system_tokens + slot_npast + 1, {slot.id + 1},
-                                    true);
-                    slot_npast += 1;
+                size_t n_branched = 0;
+                for (size_t j = 0; j < slot.sampled_draft.size(); j++) {
+                    while (n_branched < slot.draft_branches.size() &&
+                           slot.draft_branches[n_branched].depth <= int32_t(j)) {
+                        seq_ids.erase(seq_ids.begin() + 1);
+                        n_branched++;
+                    }
+                    llama_batch_add(batch, slot.sampled_draft[j], pos_draft + llama_pos(j),
+                                    seq_ids, true);
+                }
+                for (size_t b = 0; b < slot.draft_branches.size(); b++) {
+                    const server_draft_branch &branch = slot.draft_branches[b];
+                    llama_batch_add(batch, branch.tok, pos_draft + branch.depth,
+                                    {seq_draft_branch(slot, b)}, true);
                 }
             }
             slot.n_past += 1;
@@ -2185,63 +4817,60 @@ struct server_context {
         // -1: none, 0: non-embedding, 1: embedding
         int32_t batch_type = batch.n_tokens > 0 ? 0 : -1;
 
-        // next, batch any pending prompts without exceeding n_batch
+        // while any slot is generating, cap the prompt tokens of this iteration,
+        // so that long prompts are split across iterations instead of stalling the streams
+        int32_t n_prefill_max = n_batch;
+        if (prefill_budget > 0 && batch.n_tokens > 0) {
+            n_prefill_max = std::min(n_batch, prefill_budget);
+        }
+        int32_t n_prefill = 0;
+
+        // next, batch any pending prompts without exceeding n_batch,
+        // start from a different slot per iteration to avoid starving the later slots
         if (params.cont_batching || batch.n_tokens == 0) {
-            for (auto &slot : slots) {
+            const size_t i_slot_start = i_slot_prefill;
+            i_slot_prefill = (i_slot_prefill + 1) % slots.size();
+            for (size_t i_slot = 0; i_slot < slots.size(); i_slot++) {
+                server_slot &slot = slots[(i_slot_start + i_slot) % slots.size()];
+
                 // this slot still has a prompt to be processed
-                if (slot.state == SLOT_STATE_IDLE && slot.command == SLOT_COMMAND_LOAD_PROMPT) {
+                if (slot.state == SLOT_STATE_IDLE && slot.command == SLOT_COMMAND_LOAD_PROMPT &&
+                    !slot.swapped) {
                     auto &prompt_tokens = slot.prompt_tokens;
 
+                    // the spilled prefix of the prompt is still being read from disk
+                    if (slot.prefix_pending != 0) {
+                        continue;
+                    }
+
                     // we haven't tokenized the prompt yet - do it now:
                     if (prompt_tokens.empty()) {
                         slot.t_start_process_prompt = ggml_time_us();
                         slot.t_start_generation = 0;
 
-                        if (slot.infill) {
-                            bool suff_rm_leading_spc = true;
-                            if (params.input_suffix.find_first_of(' ') == 0 &&
-                                params.input_suffix.size() > 1) {
-                                params.input_suffix.erase(0, 1);
-                                suff_rm_leading_spc = false;
-                            }
-
-                            auto prefix_tokens = tokenize(slot.params.input_prefix, false);
-                            auto suffix_tokens = tokenize(slot.params.input_suffix, false);
-
-                            const int space_token = 29871; // TODO: this should not be hardcoded
-                            if (suff_rm_leading_spc && !suffix_tokens.empty() &&
-                                suffix_tokens[0] == space_token) {
-                                suffix_tokens.erase(suffix_tokens.begin());
-                            }
-
-                            prefix_tokens.insert(prefix_tokens.begin(), llama_token_prefix(model));
-                            suffix_tokens.insert(suffix_tokens.begin(), llama_token_suffix(model));
-
-                            auto embd_inp = params.spm_infill ? suffix_tokens : prefix_tokens;
-                            auto embd_end = params.spm_infill ? prefix_tokens : suffix_tokens;
-                            if (add_bos_token) {
-                                embd_inp.insert(embd_inp.begin(), llama_token_bos(model));
-                            }
-                            embd_inp.insert(embd_inp.end(), embd_end.begin(), embd_end.end());
-
-                            const llama_token middle_token = llama_token_middle(model);
-                            if (middle_token >= 0) {
-                                embd_inp.push_back(middle_token);
-                            }
-
-                            if (add_eos_token) {
-                                embd_inp.push_back(llama_token_eos(model));
-                            }
-
-                            prompt_tokens = embd_inp;
-                        } else if (!slot.oaicompat_completion_chat_vision) {
-                            // add BOS if there isn't system prompt
-                            prompt_tokens = tokenize(slot.prompt, system_prompt.empty());
+                        if (slot.prompt_staged) {
+                            prompt_tokens = std::move(slot.prompt_tokens_staged);
+                            slot.prompt_tokens_staged.clear();
+                            slot.prompt_staged = false;
+                        } else {
+                            prompt_tokens = tokenize_prompt(slot);
                         }
 
                         slot.n_past = 0;
                         slot.n_prompt_tokens = int32_t(prompt_tokens.size());
 
+                        // the cached prefix of this slot is going to be overwritten,
+                        // spill and park it if it is not reused
+                        {
+                            const size_t n_keep =
+                                slot.params.cache_prompt
+                                    ? common_part(slot.cache_tokens, prompt_tokens)
+                                    : 0;
+                            spill_prefix(slot.id + 1, n_keep);
+                            park_prefix(slot, n_keep);
+                        }
+                        prefix_cache.erase(slot.id + 1);
+
                         // empty prompt passed -> release the slot and send
                         // empty response
                         if (!slot.oaicompat_completion_chat_vision && prompt_tokens.empty()) {
@@ -2272,12 +4901,15 @@ struct server_context {
                             if (slot.params.n_keep < 0) {
                                 slot.params.n_keep = slot.n_prompt_tokens;
                             }
-                            slot.params.n_keep = std::min(slot.n_ctx - 4, slot.params.n_keep);
+                            // an elastic slot can only reserve what the system prompt leaves
+                            const int32_t n_ctx_prompt =
+                                elastic_ctx ? slot.n_ctx - n_system_tokens : slot.n_ctx;
+                            slot.params.n_keep = std::min(n_ctx_prompt - 4, slot.params.n_keep);
 
                             // if input prompt is too big, truncate it (if group
                             // attention self-extend is disabled)
-                            if (slot.ga_n == 1 && slot.n_prompt_tokens >= slot.n_ctx) {
-                                const int n_left = slot.n_ctx - slot.params.n_keep;
+                            if (slot.ga_n == 1 && slot.n_prompt_tokens >= n_ctx_prompt) {
+                                const int n_left = n_ctx_prompt - slot.params.n_keep;
 
                                 const int n_block_size = n_left / 2;
                                 const int erased_blocks =
@@ -2296,9 +4928,9 @@ struct server_context {
                                 prompt_tokens = std::move(new_tokens);
 
                                 slot.truncated = true;
-                                slot.n_prompt_tokens = n_system_tokens;
+                                slot.n_prompt_tokens = int32_t(prompt_tokens.size());
 
-                                GGML_ASSERT(slot.n_prompt_tokens < slot.n_ctx);
+                                GGML_ASSERT(slot.n_prompt_tokens < n_ctx_prompt);
                             }
 
                             llama_sampling_reset(slot.ctx_sampling);
@@ -2314,6 +4946,19 @@ struct server_context {
                                 slot.n_past =
                                     int32_t(common_part(slot.cache_tokens, prompt_tokens));
 
+                                // or the longer prefix cached by another sequence
+                                slot.n_past = reuse_prefix(slot, prompt_tokens, slot.n_past);
+
+                                // or the longer prefix spilled to the host tiers
+                                slot.n_past = restore_prefix(slot, prompt_tokens, slot.n_past);
+                                if (slot.prefix_pending != 0) {
+                                    // stage the prompt back, it starts over once read
+                                    slot.prompt_tokens_staged = std::move(prompt_tokens);
+                                    prompt_tokens.clear();
+                                    slot.prompt_staged = true;
+                                    continue;
+                                }
+
                                 // push the prompt into the sampling context (do
                                 // not apply grammar)
                                 for (int i = 0; i < slot.n_past; ++i) {
@@ -2347,6 +4992,13 @@ struct server_context {
                         }
                     }
 
+                    // cannot hold the prompt in the shared kv cache - will try
+                    // next iter
+                    if (elastic_ctx && slot.n_prompt_tokens_processed == 0 &&
+                        !reserve_kv_cells(slot, slot.n_prompt_tokens + 1)) {
+                        continue;
+                    }
+
                     // check that we are in the right batch_type, if not defer the slot
                     int32_t slot_type = slot.embedding ? 1 : 0;
                     if (batch_type == -1) {
@@ -2401,7 +5053,8 @@ struct server_context {
                     // add prompt tokens for processing in the current batch
                     // TODO: the self-extend stuff here is a mess - simplify
                     // and/or abstract it somehow
-                    for (; slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch;
+                    for (; slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch &&
+                           n_prefill < n_prefill_max;
                          ++slot.n_past) {
                         if (slot.ga_n != 1) {
                             while (slot_npast >= ga_i + ga_w) {
@@ -2424,6 +5077,7 @@ struct server_context {
 
                         slot.n_prompt_tokens_processed++;
                         slot_npast++;
+                        n_prefill++;
                     }
 
                     if (slot.oaicompat_completion_chat_vision &&
@@ -2450,20 +5104,25 @@ struct server_context {
                     }
                 }
 
-                if (batch.n_tokens >= n_batch) {
+                if (batch.n_tokens >= n_batch || n_prefill >= n_prefill_max) {
                     break;
                 }
             }
         }
 
         if (batch.n_tokens == 0) {
+            flush_deferred_tokens();
             return;
         }
 
+        // there are tokens to process, keep the loop running
+        queue_tasks.update_slots_again();
+
         // make sure we're in the right embedding mode
         llama_set_embeddings(ctx, batch_type == 1);
 
         // process the created batch of tokens
+        std::vector<server_slot_draft> drafts;
         for (int32_t i = 0; i < batch.n_tokens; i += n_batch) {
             const int32_t n_tokens = std::min(n_batch, batch.n_tokens - i);
 
@@ -2528,9 +5187,42 @@ struct server_context {
             };
             // clang-format on
 
-            const int ret = llama_decode(ctx, batch_view);
+            const int64_t t_decode_start = ggml_time_us();
+            const int ret = pipeline ? decode_pipelined(batch_view) : llama_decode(ctx, batch_view);
+            // the batches of generated tokens only, the prompts cost more, the decode may run
+            // asynchronously on the backend, wait for it to time the compute
+            if (ret == 0 && ctx_draft != nullptr &&
+                n_tokens <= int32_t(slots.size()) * (params.n_draft + 1 + n_draft_tree)) {
+                llama_synchronize(ctx);
+                update_ewma(t_decode_target, float(ggml_time_us() - t_decode_start));
+            }
             if (ret != 0) {
                 if (n_batch == 1 || ret < 0) {
+                    // no KV slot, a hard error (ret < 0) cannot be fixed by making room
+                    if (ret == 1) {
+                        // evict a parked prefix to make room
+                        if (evict_parked_prefix() > 0) {
+                            n_batch = int32_t(llama_n_batch(ctx));
+                            i -= n_batch;
+                            continue; // continue loop of n_batch
+                        }
+
+                        // preempt a slot to make room for the others
+                        server_slot *victim = get_preemptible_slot();
+                        if (victim != nullptr && preempt_slot(*victim, i)) {
+                            LOG_WARNING("failed to find free space in the KV cache, "
+                                        "preempted a slot",
+                                        {
+                                            {"i", i},
+                                            {"id_slot", victim->id},
+                                            {"id_task", victim->id_task},
+                                        });
+                            n_batch = int32_t(llama_n_batch(ctx));
+                            i -= n_batch;
+                            continue; // continue loop of n_batch
+                        }
+                    }
+
                     // if you get here, it means the KV cache is full - try
                     // increasing it via the context size
                     LOG_ERROR("failed to decode the batch: KV cache is full - "
@@ -2569,7 +5261,7 @@ struct server_context {
 
                 continue; // continue loop of n_batch
             }
-            if (ctx_draft != nullptr && batch_draft.n_tokens > 0) {
+            if (ctx_draft != nullptr && batch_draft.n_tokens > i) {
                 const int32_t n_draft_tokens = std::min(n_batch, batch_draft.n_tokens - i);
 
                 // clang-format off
@@ -2595,6 +5287,17 @@ struct server_context {
                     continue; // continue loop of slots
                 }
 
+                // stopped by the deferred bookkeeping of the previous token
+                if (slot.command == SLOT_COMMAND_RELEASE) {
+                    slot.i_batch = -1;
+                    continue; // continue loop of slots
+                }
+
+                // the prompt is in the KV cache, and the named prefix it starts with
+                if (!slot.named_prefix_pending.empty()) {
+                    adopt_named_prefix(slot);
+                }
+
                 // prompt evaluated for embedding
                 if (slot.embedding) {
                     send_embedding(slot, batch_view);
@@ -2604,25 +5307,54 @@ struct server_context {
                 }
 
                 completion_token_output result;
+                slot.n_decode_steps += 1;
                 if (!slot.sampled_draft.empty()) {
                     llama_token tok;
                     auto sz_draft = int32_t(slot.sampled_draft.size());
+                    const llama_pos pos_draft =
+                        n_system_tokens + slot.n_past + slot.n_drafted_accepted;
                     // +1 to allow for the last token to be generated
+                    int32_t n_accepted = 0;
                     for (int32_t j = 0; j < sz_draft + 1; ++j) {
-                        // greedy verification only
                         bool accept = false;
+                        int32_t i_branch = -1;
                         tok = llama_sampling_sample(slot.ctx_sampling, ctx, nullptr,
                                                     slot.i_batch - i + j);
+                        if (j < sz_draft) {
+                            // the target sample is exact, however, it rarely matches the draft
+                            // unless sampling greedily
+                            accept = slot.draft_stochastic ? slot.accept_draft(size_t(j), tok)
+                                                           : tok == slot.sampled_draft[j];
+                            if (!accept) {
+                                i_branch = slot.find_draft_branch(j, tok);
+                            }
+                        }
                         llama_sampling_accept(slot.ctx_sampling, ctx, tok, true);
                         slot.push_token_into_result(tok, result, ctx);
-                        if (j < sz_draft && tok == slot.sampled_draft[j]) {
-                            accept = true;
-                        }
                         slot.n_decoded += 1;
+                        if (i_branch >= 0) {
+                            slot.n_drafted_accepted += 1;
+                            n_accepted += 1;
+                            take_draft_branch(slot, size_t(i_branch), pos_draft + j);
+                            // the alternative is a leaf, sample the last token after it
+                            tok = llama_sampling_sample(slot.ctx_sampling, ctx, nullptr,
+                                                        slot.i_batch - i + 1 + sz_draft +
+                                                            i_branch);
+                            llama_sampling_accept(slot.ctx_sampling, ctx, tok, true);
+                            slot.push_token_into_result(tok, result, ctx);
+                            slot.n_decoded += 1;
+                            break;
+                        }
                         if (!accept) {
                             break;
                         }
                         slot.n_drafted_accepted += 1;
+                        n_accepted += 1;
+                    }
+                    clear_draft_branches(slot);
+                    slot.on_draft_verified(sz_draft, n_accepted);
+                    if (draft_adaptive && ctx_draft != nullptr) {
+                        slot.n_draft = best_draft_length(slot.draft_accepted_ewma);
                     }
                 } else {
                     llama_token tok =
@@ -2637,6 +5369,7 @@ struct server_context {
                     slot.t_prompt_processing =
                         double(slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
                     metrics.on_prompt_eval(slot);
+                    load.on_prompt_eval(slot);
                 }
 
                 if (ctx_draft != nullptr) {
@@ -2645,40 +5378,27 @@ struct server_context {
                     llama_kv_cache_seq_rm(ctx_draft, slot.id + 1, pos, -1);
 
                     slot.sampled_draft.clear();
+                    slot.sampled_draft_probs.clear();
                     llama_sampling_cp(slot.ctx_sampling, slot.ctx_sampling_draft);
+                    slot.push_draft_tail(result.toks, pos);
 
-                    llama_batch_clear(batch_draft);
-                    llama_batch_add(batch_draft, result.toks[result.toks.size() - 1], pos,
-                                    {slot.id + 1}, true);
-                    if (llama_decode(ctx_draft, batch_draft)) {
-                        slot.state = SLOT_STATE_PROCESSING;
-                        slot.command = SLOT_COMMAND_NONE;
-                        slot.release();
-                        send_error(slot, "Failed to draft decode", ERROR_TYPE_SERVER);
-                        continue; // continue loop of slots
+                    // probe a paused speculation from time to time
+                    int32_t n_draft = slot.n_draft;
+                    if (n_draft == 0 && ++slot.n_draft_paused >= 16) {
+                        slot.n_draft_paused = 0;
+                        n_draft = 1;
                     }
-                    slot.n_drafted += 1;
 
-                    for (int32_t j = 0; j < params.n_draft; ++j) {
-                        llama_token tok =
-                            llama_sampling_sample(slot.ctx_sampling_draft, ctx_draft, nullptr, 0);
-                        slot.sampled_draft.push_back(tok);
-                        llama_sampling_accept(slot.ctx_sampling_draft, ctx_draft, tok, true);
-                        if (llama_token_is_eog(model_draft, tok)) {
-                            break;
-                        }
-                        llama_batch_clear(batch_draft);
-                        llama_batch_add(batch_draft, tok, pos + 1 + j, {slot.id + 1}, true);
-                        if (llama_decode(ctx_draft, batch_draft)) {
-                            break;
-                        }
-                        slot.n_drafted += 1;
+                    // drafted along with the other slots once the batch is done
+                    if (n_draft > 0) {
+                        drafts.push_back({slot.id, pos, n_draft, -1});
                     }
                 } else if (lookup_ngram_min > 0) {
                     llama_pos pos = n_system_tokens + slot.n_past + slot.n_drafted_accepted;
                     llama_kv_cache_seq_rm(ctx, slot.id + 1, pos, -1);
 
                     slot.sampled_draft.clear();
+                    slot.sampled_draft_probs.clear();
 
                     slot.sampled_draft.push_back(result.toks[result.toks.size() - 1]);
                     llama_ngram_cache_draft(slot.prompt_tokens, slot.sampled_draft, params.n_draft,
@@ -2687,17 +5407,129 @@ struct server_context {
                     slot.n_drafted += int32_t(slot.sampled_draft.size()) - 1;
 
                     slot.sampled_draft.erase(slot.sampled_draft.begin());
+                    if (n_draft_tree > 0) {
+                        slot.n_drafted += slot.push_ngram_branches(n_draft_tree);
+                    }
                 }
 
-                if (!process_token(result, slot)) {
+                push_sampled(result, slot);
+                if (output_thread) {
+                    emit_token(slot, std::move(result));
+                } else if (pipeline) {
+                    // the next batch only needs the sampled tokens,
+                    // the rest overlaps with the next decode
+                    slot.finishing = match_stop_tokens(result, slot);
+                    deferred_tokens.push_back({slot.id, slot.id_task, std::move(result)});
+                } else if (!process_token(result, slot)) {
                     slot.release();
                     send_final_response(slot);
                     metrics.on_prediction(slot);
+                    load.on_prediction(slot);
                 }
 
                 slot.i_batch = -1;
             }
         }
+
+        draft_slots(drafts);
+    }
+
+    // draft the next tokens of the speculating slots, the draft model decodes one token of
+    // every slot per step, the slots drafting an end of generation or enough drop out
+    void draft_slots(const std::vector<server_slot_draft> &drafts) {
+        if (drafts.empty()) {
+            return;
+        }
+
+        // catch the draft KV cache up with the tokens it misses, i.e. the last draft of a round
+        // accepted as a whole, and the tokens generated while not speculating
+        std::vector<server_slot_draft> active;
+        llama_batch_clear(batch_draft);
+        for (const server_slot_draft &draft : drafts) {
+            const server_slot &slot = slots[draft.id_slot];
+            if (slot.command == SLOT_COMMAND_RELEASE || slot.finishing) {
+                continue;
+            }
+            for (size_t t = 0; t < slot.draft_tail.size(); t++) {
+                llama_batch_add(batch_draft, slot.draft_tail[t],
+                                slot.draft_tail_pos + llama_pos(t), {slot.id + 1},
+                                t + 1 == slot.draft_tail.size());
+            }
+            active.push_back(draft);
+            active.back().i_batch = batch_draft.n_tokens - 1;
+        }
+
+        for (int32_t j = 0; j < params.n_draft && !active.empty(); ++j) {
+            const int64_t t_decode_start = ggml_time_us();
+            if (llama_decode(ctx_draft, batch_draft)) {
+                // verify what is drafted so far
+                LOG_WARNING("failed to draft decode", {{"n_slots", active.size()}, {"j", j}});
+                break;
+            }
+            if (j > 0) {
+                llama_synchronize(ctx_draft);
+                update_ewma(t_decode_draft, float(ggml_time_us() - t_decode_start));
+            }
+
+            std::vector<server_slot_draft> next;
+            llama_batch_clear(batch_draft);
+            for (const server_slot_draft &draft : active) {
+                server_slot &slot = slots[draft.id_slot];
+                slot.n_past_draft = draft.pos + 1;
+                slot.draft_tail.clear();
+
+                const llama_token tok = llama_sampling_sample(slot.ctx_sampling_draft, ctx_draft,
+                                                              nullptr, draft.i_batch);
+                slot.sampled_draft.push_back(tok);
+                if (slot.draft_stochastic) {
+                    slot.push_draft_probs(slot.ctx_sampling_draft);
+                }
+                if (slot.push_draft_branch(slot.ctx_sampling_draft, n_draft_tree)) {
+                    slot.n_drafted += 1;
+                }
+                llama_sampling_accept(slot.ctx_sampling_draft, ctx_draft, tok, true);
+                slot.n_drafted += 1;
+                // the last draft is not decoded, nothing reads its logits, if accepted
+                // it reaches the draft KV cache with the tail of the next round
+                if (llama_token_is_eog(model_draft, tok) ||
+                    int32_t(slot.sampled_draft.size()) >= draft.n_draft) {
+                    continue;
+                }
+                next.push_back({slot.id, draft.pos + 1, draft.n_draft, batch_draft.n_tokens});
+                llama_batch_add(batch_draft, tok, draft.pos + 1, {slot.id + 1}, true);
+            }
+            active.swap(next);
+        }
+        llama_batch_clear(batch_draft);
+    }
+
+    static void update_ewma(float &avg, float value) {
+        avg = avg > 0.0f ? avg + 0.1f * (value - avg) : value;
+    }
+
+    // the draft length maximizing the tokens per unit of time, a round of k drafts yields
+    // 1 + a + ... + a^k tokens, accepted at a rate a, in the time of a target decode and k
+    // draft decodes, c each relative to the target one, 0 pauses the speculation
+    int32_t best_draft_length(float a) const {
+        if (t_decode_target <= 0.0f || t_decode_draft <= 0.0f) {
+            return params.n_draft;
+        }
+        const float c = t_decode_draft / t_decode_target;
+
+        int32_t best = 0;
+        float best_rate = 1.0f;
+        float n_tokens = 1.0f;
+        float a_k = 1.0f;
+        for (int32_t k = 1; k <= params.n_draft; k++) {
+            a_k *= a;
+            n_tokens += a_k;
+            const float rate = n_tokens / (1.0f + float(k) * c);
+            if (rate > best_rate) {
+                best = k;
+                best_rate = rate;
+            }
+        }
+        return best;
     }
 
     bool process_vision_prompt(server_slot &slot, int n_batch) {
@@ -2904,7 +5736,7 @@ int main(int argc, char **argv) {
     // CORS preflight
     svr.Options(R"(.*)", [](const httplib::Request &req, httplib::Response &res) {
         res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-        res.set_header("Access-Control-Allow-Methods", "POST");
+        res.set_header("Access-Control-Allow-Methods", "POST, DELETE");
         res.set_header("Access-Control-Allow-Headers", "*");
         return res.set_content("", "application/json; charset=utf-8");
     });
@@ -2987,12 +5819,60 @@ int main(int argc, char **argv) {
             }
         }
         LOG_INFO("chat template", {{"template", params.chat_template}});
+        ctx_server.init_chat_cache(params.chat_template);
     }
 
     //
     // Handlers
     //
 
+    // reject the request early if it cannot be served in time,
+    // so that the client can retry on another replica,
+    // the admitted task is counted as waiting, and carries the prompt tokens if tokenized
+    const auto admit = [&ctx_server, &res_error](const json &request, httplib::Response &res,
+                                                 server_task &task) -> bool {
+        if (ctx_server.slo_ttft > 0) {
+            int32_t n_prompt_tokens = 0;
+            if (!server_context::is_multiprompt(request) &&
+                ctx_server.tokenize_prompt(request, false, task.prompt_tokens)) {
+                task.tokenized = true;
+                n_prompt_tokens = int32_t(task.prompt_tokens.size());
+            } else if (request.contains("prompt")) {
+                const json &prompt = request.at("prompt");
+                if (prompt.is_string() || prompt.is_array()) {
+                    n_prompt_tokens = int32_t(ctx_server.tokenize(prompt, false).size());
+                }
+            }
+            const int64_t t_ttft = ctx_server.load.estimate_ttft(n_prompt_tokens);
+            if (t_ttft > ctx_server.slo_ttft) {
+                const int64_t t_over = t_ttft - ctx_server.slo_ttft;
+                res.set_header("Retry-After",
+                               std::to_string(std::max(int64_t(1), (t_over + 999) / 1000)));
+                res_error(res, format_error_response(
+                                   "The estimated time to first token (" +
+                                       std::to_string(t_ttft) + "ms) exceeds the limit (" +
+                                       std::to_string(ctx_server.slo_ttft) + "ms)",
+                                   ERROR_TYPE_UNAVAILABLE));
+                return false;
+            }
+        }
+
+        // counted before the check, so that concurrent requests cannot pass the limit together
+        server_admission admission(ctx_server.load.n_waiting_tasks);
+        if (ctx_server.max_queued > 0 &&
+            admission.n_ahead - ctx_server.load.n_idle_slots >= ctx_server.max_queued) {
+            admission.release();
+            const int64_t t_wait = ctx_server.load.estimate_slot_wait();
+            res.set_header("Retry-After", std::to_string(std::max(int64_t(1), t_wait / 1000)));
+            res_error(res, format_error_response("Too many requests waiting for an available slot",
+                                                 ERROR_TYPE_TOO_MANY_REQUESTS));
+            return false;
+        }
+        task.admission = std::move(admission);
+
+        return true;
+    };
+
     const auto handle_health = [&](const httplib::Request &req, httplib::Response &res) {
         server_state current_state = state.load();
         switch (current_state) {
@@ -3003,7 +5883,7 @@ int main(int argc, char **argv) {
             task.type = SERVER_TASK_TYPE_METRICS;
 
             // post the task
-            task.id = ctx_server.queue_tasks.post(task);
+            task.id = ctx_server.queue_tasks.post(std::move(task));
             ctx_server.queue_results.add_waiting_task_id(task.id);
 
             // get the result
@@ -3049,7 +5929,7 @@ int main(int argc, char **argv) {
         task.data.push_back({{"reset_bucket", true}});
 
         // post the task
-        task.id = ctx_server.queue_tasks.post(task);
+        task.id = ctx_server.queue_tasks.post(std::move(task));
         ctx_server.queue_results.add_waiting_task_id(task.id);
 
         // get the result
@@ -3073,6 +5953,13 @@ int main(int argc, char **argv) {
             uint64_t kv_cache_tokens_count = data.at("kv_cache_tokens_count");
             uint64_t processing = data.at("processing");
             uint64_t deferred = data.at("deferred");
+            uint64_t tokenize_cache_hits_total = data.at("tokenize_cache_hits_total");
+            uint64_t tokenize_cache_misses_total = data.at("tokenize_cache_misses_total");
+            uint64_t tokenize_cache_tokens = data.at("tokenize_cache_tokens");
+            const uint64_t tokenize_cache_lookups_total =
+                tokenize_cache_hits_total + tokenize_cache_misses_total;
+            const std::vector<std::vector<uint64_t>> drafted_accepted_hist =
+                data.at("drafted_accepted_hist");
 
             // metrics definition:
             // https://prometheus.io/docs/practices/naming/#metric-names
@@ -3095,7 +5982,13 @@ int main(int argc, char **argv) {
                    {"value", n_tokens_drafted_total}},
                   {{"name", "tokens_drafted_accepted_total"},
                    {"help", "Number of speculative decoding tokens to be accepted."},
-                   {"value", n_tokens_drafted_accepted_total}}}},
+                   {"value", n_tokens_drafted_accepted_total}},
+                  {{"name", "tokenize_cache_hits_total"},
+                   {"help", "Number of text segments found in the tokenization cache."},
+                   {"value", tokenize_cache_hits_total}},
+                  {{"name", "tokenize_cache_misses_total"},
+                   {"help", "Number of text segments missing from the tokenization cache."},
+                   {"value", tokenize_cache_misses_total}}}},
                 {"gauge",
                  {{{"name", "prompt_tokens_seconds"},
                    {"help", "Average prompt throughput in tokens/s."},
@@ -3118,7 +6011,19 @@ int main(int argc, char **argv) {
                    {"value", processing}},
                   {{"name", "requests_deferred"},
                    {"help", "Number of request deferred."},
-                   {"value", deferred}}}}};
+                   {"value", deferred}},
+                  {{"name", "tokenize_cache_hit_ratio"},
+                   {"help", "Tokenization cache hit ratio. 1 means 100 percent hits."},
+                   {"value", tokenize_cache_lookups_total ? double(tokenize_cache_hits_total) /
+                                                               double(tokenize_cache_lookups_total)
+                                                         : 0.}},
+                  {{"name", "tokenize_cache_tokens"},
+                   {"help", "Tokens held by the tokenization cache."},
+                   {"value", tokenize_cache_tokens}}}},
+                {"histogram",
+                 {{{"name", "tokens_drafted_accepted_per_step"},
+                   {"help", "Number of speculative decoding tokens accepted per verification."},
+                   {"buckets", drafted_accepted_hist}}}}};
 
             for (const auto &el : all_metrics_def.items()) {
                 const auto &type = el.key();
@@ -3128,10 +6033,32 @@ int main(int argc, char **argv) {
                     const std::string name = metric_def.at("name");
                     const std::string help = metric_def.at("help");
 
-                    auto value = json_value(metric_def, "value", 0.);
                     metrics << "# HELP llamacpp:" << name << " " << help << "\n"
-                            << "# TYPE llamacpp:" << name << " " << type << "\n"
-                            << "llamacpp:" << name << " " << value << "\n";
+                            << "# TYPE llamacpp:" << name << " " << type << "\n";
+                    if (!metric_def.contains("buckets")) {
+                        auto value = json_value(metric_def, "value", 0.);
+                        metrics << "llamacpp:" << name << " " << value << "\n";
+                        continue;
+                    }
+
+                    // the buckets of a slot count the observations of each value
+                    const std::vector<std::vector<uint64_t>> buckets = metric_def.at("buckets");
+                    for (size_t id = 0; id < buckets.size(); id++) {
+                        const std::string label = "id_slot=\"" + std::to_string(id) + "\"";
+                        uint64_t count = 0;
+                        uint64_t sum = 0;
+                        for (size_t v = 0; v < buckets[id].size(); v++) {
+                            count += buckets[id][v];
+                            sum += buckets[id][v] * v;
+                            metrics << "llamacpp:" << name << "_bucket{" << label << ",le=\"" << v
+                                    << "\"} " << count << "\n";
+                        }
+                        metrics << "llamacpp:" << name << "_bucket{" << label << ",le=\"+Inf\"} "
+                                << count << "\n"
+                                << "llamacpp:" << name << "_sum{" << label << "} " << sum << "\n"
+                                << "llamacpp:" << name << "_count{" << label << "} " << count
+                                << "\n";
+                    }
                 }
             }
         }
@@ -3184,12 +6111,24 @@ int main(int argc, char **argv) {
             }
         }
 
+        int priority = 0;
+        {
+            const std::string priority_s = req.get_header_value("X-Request-Priority");
+            if (!priority_s.empty()) {
+                try {
+                    priority = std::stoi(priority_s);
+                } catch (const std::exception &) {
+                    priority = 0;
+                }
+            }
+        }
+
         const json request = json::parse(req.body);
 
         // post the task
         const int id_task = ctx_server.queue_tasks.get_new_id();
         ctx_server.queue_results.add_waiting_task_id(id_task);
-        ctx_server.request_completion(id_task, -1, request, true, false, tps);
+        ctx_server.request_completion(id_task, -1, request, true, false, tps, priority);
 
         // process non-streaming requests
         if (!json_value(request, "stream", false)) {
@@ -3290,7 +6229,7 @@ int main(int argc, char **argv) {
         task.type = SERVER_TASK_TYPE_METRICS;
 
         // post the task
-        task.id = ctx_server.queue_tasks.post(task);
+        task.id = ctx_server.queue_tasks.post(std::move(task));
         ctx_server.queue_results.add_waiting_task_id(task.id);
 
         // get the result
@@ -3317,7 +6256,7 @@ int main(int argc, char **argv) {
         task.data = {{"id_slot", id_slot}, {"filename", filename}, {"filepath", filepath}};
 
         // post the task
-        task.id = ctx_server.queue_tasks.post(task);
+        task.id = ctx_server.queue_tasks.post(std::move(task));
         ctx_server.queue_results.add_waiting_task_id(task.id);
 
         // get the result
@@ -3349,7 +6288,7 @@ int main(int argc, char **argv) {
         task.data = {{"id_slot", id_slot}, {"filename", filename}, {"filepath", filepath}};
 
         // post the task
-        task.id = ctx_server.queue_tasks.post(task);
+        task.id = ctx_server.queue_tasks.post(std::move(task));
         ctx_server.queue_results.add_waiting_task_id(task.id);
 
         // get the result
@@ -3371,7 +6310,7 @@ int main(int argc, char **argv) {
         task.data = {{"id_slot", id_slot}};
 
         // post the task
-        task.id = ctx_server.queue_tasks.post(task);
+        task.id = ctx_server.queue_tasks.post(std::move(task));
         ctx_server.queue_results.add_waiting_task_id(task.id);
 
         // get the result
@@ -3453,7 +6392,7 @@ int main(int argc, char **argv) {
         // post the task
         server_task task;
         task.type = SERVER_TASK_TYPE_SET_LORA;
-        task.id = ctx_server.queue_tasks.post(task);
+        task.id = ctx_server.queue_tasks.post(std::move(task));
         ctx_server.queue_results.add_waiting_task_id(task.id);
 
         // get the result
@@ -3463,8 +6402,8 @@ int main(int argc, char **argv) {
         res.set_content(result.data.dump(), "application/json; charset=utf-8");
     };
 
-    const auto handle_completions = [&ctx_server, &res_error](const httplib::Request &req,
-                                                              httplib::Response &res) {
+    const auto handle_completions = [&ctx_server, &res_error, &admit](const httplib::Request &req,
+                                                                      httplib::Response &res) {
         // llama_supports_embedding_only is a patch.
         if (llama_supports_embedding_only(ctx_server.ctx)) {
             res.status = httplib::StatusCode::Forbidden_403;
@@ -3498,6 +6437,18 @@ int main(int argc, char **argv) {
             }
         }
 
+        int priority = 0;
+        {
+            const std::string priority_s = req.get_header_value("X-Request-Priority");
+            if (!priority_s.empty()) {
+                try {
+                    priority = std::stoi(priority_s);
+                } catch (const std::exception &) {
+                    priority = 0;
+                }
+            }
+        }
+
         bool oaicompat = req.path == "/v1/completions";
         json request = json::parse(req.body);
         if (!request.contains("prompt")) {
@@ -3508,11 +6459,16 @@ int main(int argc, char **argv) {
         if (oaicompat) {
             request = oaicompat_completion_request(ctx_server.model, request, std::string());
         }
+        server_task task;
+        if (!admit(request, res, task)) {
+            return;
+        }
 
         // post the task
         const int id_task = ctx_server.queue_tasks.get_new_id();
         ctx_server.queue_results.add_waiting_task_id(id_task);
-        ctx_server.request_completion(id_task, -1, request, false, false, tps);
+        ctx_server.request_completion(id_task, -1, request, false, false, tps, priority,
+                                      std::move(task));
 
         const std::string completion_id = gen_cmplid();
 
@@ -3608,7 +6564,7 @@ int main(int argc, char **argv) {
         res.set_content(models.dump(), "application/json; charset=utf-8");
     };
 
-    const auto handle_chat_completions = [&ctx_server, &params, &res_error](
+    const auto handle_chat_completions = [&ctx_server, &params, &res_error, &admit](
                                              const httplib::Request &req, httplib::Response &res) {
         // llama_supports_embedding_only is a patch.
         if (llama_supports_embedding_only(ctx_server.ctx)) {
@@ -3643,6 +6599,18 @@ int main(int argc, char **argv) {
             }
         }
 
+        int priority = 0;
+        {
+            const std::string priority_s = req.get_header_value("X-Request-Priority");
+            if (!priority_s.empty()) {
+                try {
+                    priority = std::stoi(priority_s);
+                } catch (const std::exception &) {
+                    priority = 0;
+                }
+            }
+        }
+
         json request = json::parse(req.body);
         if (!request.contains("messages") || !request.at("messages").is_array()) {
             res_error(res,
@@ -3650,12 +6618,28 @@ int main(int argc, char **argv) {
                                             ERROR_TYPE_INVALID_REQUEST));
             return;
         }
-        request = oaicompat_completion_request(ctx_server.model, request, params.chat_template);
+        // tokenize the new messages only, if the chat template allows
+        json prompt;
+        {
+            const bool add_special = ctx_server.system_prompt.empty() &&
+                                     json_value(request, "id_prefix", std::string()).empty();
+            std::vector<llama_token> prompt_tokens;
+            if (ctx_server.tokenize_chat(request.at("messages"), add_special, prompt_tokens)) {
+                prompt = std::move(prompt_tokens);
+            }
+        }
+        request = oaicompat_completion_request(ctx_server.model, request, params.chat_template,
+                                               prompt);
+        server_task task;
+        if (!admit(request, res, task)) {
+            return;
+        }
 
         // post the task
         const int id_task = ctx_server.queue_tasks.get_new_id();
         ctx_server.queue_results.add_waiting_task_id(id_task);
-        ctx_server.request_completion(id_task, -1, request, false, false, tps);
+        ctx_server.request_completion(id_task, -1, request, false, false, tps, priority,
+                                      std::move(task));
 
         const std::string completion_id = gen_chatcmplid();
 
@@ -3773,6 +6757,80 @@ int main(int argc, char **argv) {
         ctx_server.queue_results.remove_waiting_task_id(id_task);
     };
 
+    const auto handle_prefixes = [&ctx_server](const httplib::Request &, httplib::Response &res) {
+        server_task task;
+        task.type = SERVER_TASK_TYPE_PREFIX_LIST;
+
+        // post the task
+        task.id = ctx_server.queue_tasks.post(std::move(task));
+        ctx_server.queue_results.add_waiting_task_id(task.id);
+
+        // get the result
+        server_task_result result = ctx_server.queue_results.recv(task.id);
+        ctx_server.queue_results.remove_waiting_task_id(task.id);
+
+        res.set_content(result.data.at("prefixes").dump(), "application/json");
+    };
+
+    const auto handle_prefixes_add = [&ctx_server, &res_error](const httplib::Request &req,
+                                                               httplib::Response &res) {
+        const json request = json::parse(req.body);
+
+        const std::string id_prefix = json_value(request, "id", std::string());
+        if (id_prefix.empty()) {
+            res_error(res, format_error_response("\"id\" must be provided",
+                                                 ERROR_TYPE_INVALID_REQUEST));
+            return;
+        }
+        const auto &prompt = request.find("prompt");
+        if (prompt == request.end() || !(prompt->is_string() || prompt->is_array())) {
+            res_error(res, format_error_response("\"prompt\" must be a string or an array",
+                                                 ERROR_TYPE_INVALID_REQUEST));
+            return;
+        }
+
+        server_task task;
+        task.type = SERVER_TASK_TYPE_PREFIX_ADD;
+        task.data = {{"id_prefix", id_prefix}, {"prompt", *prompt}};
+
+        // post the task
+        task.id = ctx_server.queue_tasks.post(std::move(task));
+        ctx_server.queue_results.add_waiting_task_id(task.id);
+
+        // get the result
+        server_task_result result = ctx_server.queue_results.recv(task.id);
+        ctx_server.queue_results.remove_waiting_task_id(task.id);
+
+        if (result.error) {
+            res_error(res, result.data);
+            return;
+        }
+
+        res.set_content(result.data.dump(), "application/json");
+    };
+
+    const auto handle_prefixes_delete = [&ctx_server, &res_error](const httplib::Request &req,
+                                                                  httplib::Response &res) {
+        server_task task;
+        task.type = SERVER_TASK_TYPE_PREFIX_DELETE;
+        task.data = {{"id_prefix", req.path_params.at("id_prefix")}};
+
+        // post the task
+        task.id = ctx_server.queue_tasks.post(std::move(task));
+        ctx_server.queue_results.add_waiting_task_id(task.id);
+
+        // get the result
+        server_task_result result = ctx_server.queue_results.recv(task.id);
+        ctx_server.queue_results.remove_waiting_task_id(task.id);
+
+        if (result.error) {
+            res_error(res, result.data);
+            return;
+        }
+
+        res.set_content(result.data.dump(), "application/json");
+    };
+
     //
     // Router
     //
@@ -3801,6 +6859,11 @@ int main(int argc, char **argv) {
             svr.Post("/lora-adapters", handle_lora_adapters_apply);
         }
     }
+    if (bparams.n_named_prefixes > 0) {
+        svr.Get("/v1/prefixes", handle_prefixes);
+        svr.Post("/v1/prefixes", handle_prefixes_add);
+        svr.Delete("/v1/prefixes/:id_prefix", handle_prefixes_delete);
+    }
     svr.Post("/completion", handle_completions);
     svr.Get("/v1/models", handle_models);
     svr.Post("/v1/completions", handle_completions);
@@ -3814,7 +6877,7 @@ int main(int argc, char **argv) {
     //
 
     svr.set_post_routing_handler([](const httplib::Request &req, httplib::Response &res) {
-        if (req.method == "POST") {
+        if (req.method == "POST" || req.method == "DELETE") {
             res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
         }
         return httplib::Server::HandlerResponse::Handled;
@@ -21,10 +21,29 @@ using json = nlohmann::json;
 struct llama_box_params {
     gpt_params gparams;
 
-    int32_t conn_idle = 60;       // connection idle in seconds
-    int32_t conn_keepalive = 15;  // connection keep-alive in seconds
-    int32_t n_tps = 0;            // maximum number of tokens per seconds
-    int32_t lookup_ngram_min = 0; // minimum n-gram size for lookup cache
+    int32_t conn_idle = 60;               // connection idle in seconds
+    int32_t conn_keepalive = 15;          // connection keep-alive in seconds
+    int32_t n_tps = 0;                    // maximum number of tokens per seconds
+    int32_t lookup_ngram_min = 0;         // minimum n-gram size for lookup cache
+    bool draft_adaptive = false;          // adapt the draft length of each slot
+    int32_t draft_tree = 0;               // alternative draft branches verified per slot
+    std::string sched_policy = "fcfs";    // scheduling policy of deferred requests
+    int32_t sched_max_wait = 30;          // maximum seconds a deferred request is passed over
+    int32_t prefill_budget = 0;           // maximum prompt tokens per iteration while generating
+    int32_t max_queued = 0;               // maximum requests waiting for an available slot
+    int32_t slo_ttft = 0;                 // maximum estimated milliseconds to the first token
+    bool elastic_ctx = false;             // slots draw context from the shared KV cache on demand
+    int32_t n_prefix_cache_parked = 0;    // extra sequences to park the cached prefixes
+    int32_t prefix_cache_ram = 0;         // MiB of host RAM to spill the cached prefixes
+    int32_t prefix_cache_disk = 0;        // MiB of disk to spill the cached prefixes
+    int32_t n_named_prefixes = 0;         // reserved sequences to hold the named prefixes
+    int32_t named_prefixes_ctx = 0;       // KV cells reserved for the named prefixes
+    int32_t slot_save_deltas = 0;         // max delta segments of a slot save file
+    std::string slot_save_quant = "none"; // quantization of the slot save files
+    bool pipeline = false;                // overlap the decode with the bookkeeping of the slots
+    bool output_thread = false;           // run the text work of the sampled tokens on a thread
+    int32_t tokenize_cache = 0;           // max tokens held by the tokenization cache
+    int32_t chat_cache = 0;               // max tokens held by the chat message cache
 };
 
 static int unknown(const char *flag) {
@@ -220,6 +239,44 @@ static void llama_box_params_print_usage(int, char **argv, const llama_box_param
     opts.push_back({ "server",      "       --conn-keepalive N",     "server connection keep-alive in seconds (default: %d)", bparams.conn_keepalive });
     opts.push_back({ "server",      "-tps   --tokens-per-second N",  "maximum number of tokens per second (default: %d, 0 = disabled, -1 = try to detect)\n"
                                                                      "when enabled, limit the request within its X-Request-Tokens-Per-Second HTTP header.", bparams.n_tps });
+    opts.push_back({ "server",      "       --sched-policy POLICY",  "scheduling policy of the requests waiting for an available slot, select from fcfs, sjf, priority (default: %s)\n"
+                                                                     "sjf serves the shortest prompt plus n_predict first,\n"
+                                                                     "priority serves the larger X-Request-Priority HTTP header first.", bparams.sched_policy.c_str() });
+    opts.push_back({ "server",      "       --sched-max-wait N",     "maximum number of seconds a request waiting for an available slot can be passed over by sjf or priority,\n"
+                                                                     "after which it is served in arrival order (default: %d, 0 = unbounded)", bparams.sched_max_wait });
+    opts.push_back({ "server",      "       --prefill-budget N",     "maximum number of prompt tokens to process per iteration while any slot is generating (default: %d, 0 = up to batch size)\n"
+                                                                     "long prompts are split across iterations to bound the inter-token latency of running requests.", bparams.prefill_budget });
+    opts.push_back({ "server",      "       --max-queued N",         "maximum number of requests waiting for an available slot (default: %d, 0 = unlimited)\n"
+                                                                     "when exceeded, reject the completion requests with 429 and Retry-After HTTP header.", bparams.max_queued });
+    opts.push_back({ "server",      "       --slo-ttft N",           "maximum estimated time to first token in milliseconds (default: %d, 0 = disabled)\n"
+                                                                     "when exceeded, reject the completion requests with 503 and Retry-After HTTP header.", bparams.slo_ttft });
+    opts.push_back({ "server",      "       --elastic-ctx",          "let slots draw context from the whole KV cache on demand instead of a fixed size of ctx-size / parallel (default: %s)\n"
+                                                                     "a request can cap its own context with the n_ctx field.", bparams.elastic_ctx ? "enabled" : "disabled" });
+    opts.push_back({ "server",      "       --prefix-cache-parked N",
+                                                                     "number of extra KV sequences to park the cached prompt prefixes of the slots (default: %d)\n"
+                                                                     "requests with cache_prompt reuse the longest prefix cached by any slot or parked sequence.", bparams.n_prefix_cache_parked });
+    opts.push_back({ "server",      "       --prefix-cache-ram N",   "size in MiB of the host RAM tier to spill the KV state of the recycled slots (default: %d, 0 = disabled)\n"
+                                                                     "requests with cache_prompt restore the longest spilled prefix instead of recomputing it.", bparams.prefix_cache_ram });
+    opts.push_back({ "server",      "       --prefix-cache-disk N",  "size in MiB of the disk tier under --slot-save-path to spill the host RAM tier (default: %d, 0 = disabled)", bparams.prefix_cache_disk });
+    opts.push_back({ "server",      "       --named-prefixes N",     "number of reserved KV sequences to hold the named prefixes registered via /v1/prefixes (default: %d, 0 = disabled)\n"
+                                                                     "requests with id_prefix fork from the named prefix instead of prefilling it.", bparams.n_named_prefixes });
+    opts.push_back({ "server",      "       --named-prefixes-ctx N", "number of KV cells reserved for the named prefixes on top of ctx-size, shared with the slots if ctx-size is 0 (default: %d, 0 = 4096 per named prefix)\n"
+                                                                     "the least recently used named prefixes are evicted from the KV cache when exceeded.", bparams.named_prefixes_ctx });
+    opts.push_back({ "server",      "       --slot-save-deltas N",   "maximum number of delta segments appended to a slot save file before compacting it (default: %d, 0 = always save in full)\n"
+                                                                     "saving a slot again only writes the tokens appended since the last save or restore of the same file.", bparams.slot_save_deltas });
+    opts.push_back({ "server",      "       --slot-save-quant {none,q8_0,q4_0}",
+                                                                     "quantize the f16/f32 K/V data of the slot save files (default: %s)\n"
+                                                                     "quantized files carry a checksum and the model fingerprint, and only restore into the same model.", bparams.slot_save_quant.c_str() });
+    opts.push_back({ "server",      "       --pipeline",             "run the decode on a worker thread and overlap it with the stop checks, responses and prompt tokenization of the slots (default: %s)\n"
+                                                                     "the generated tokens reach the clients one step later, and a finishing slot decodes one extra token.\n"
+                                                                     "the prompt chunks and the drafts of the next batch are still prepared after the decode.", bparams.pipeline ? "enabled" : "disabled" });
+    opts.push_back({ "server",      "       --output-thread",        "run the detokenization, stop-string checks and response serialization of the generated tokens on a dedicated output thread (default: %s)\n"
+                                                                     "the main loop only batches, decodes and samples.", bparams.output_thread ? "enabled" : "disabled" });
+    opts.push_back({ "server",      "       --tokenize-cache N",     "maximum number of tokens held by the LRU cache of tokenized text segments (default: %d, 0 = disabled)\n"
+                                                                     "repeated system prompts, tool descriptions or documents are looked up instead of tokenized again.", bparams.tokenize_cache });
+    opts.push_back({ "server",      "       --chat-cache N",         "maximum number of tokens held by the LRU cache of rendered chat messages (default: %d, 0 = disabled)\n"
+                                                                     "only the messages new since the previous turns of a chat are rendered and tokenized,\n"
+                                                                     "needs a chat template that renders a message regardless of the previous ones.", bparams.chat_cache });
 
     opts.push_back({ "logging" });
     opts.push_back({ "logging",     "       --log-format {text,json}",
@@ -227,6 +284,10 @@ static void llama_box_params_print_usage(int, char **argv, const llama_box_param
 
     opts.push_back({ "speculative" });
     opts.push_back({ "speculative", "       --draft N",              "number of tokens to draft for speculative decoding (default: %d)", params.n_draft });
+    opts.push_back({ "speculative", "       --draft-adaptive",       "adapt the number of tokens to draft of each slot, up to --draft, to the acceptance rate\n"
+                                                                     "and the cost of the draft model, pausing speculative decoding when it does not pay (default: %s)", bparams.draft_adaptive ? "enabled" : "disabled" });
+    opts.push_back({ "speculative", "       --draft-tree N",         "number of alternative tokens to verify along with the drafted ones of each slot, taken where\n"
+                                                                     "the draft is uncertain, so that a mismatch can still be accepted (default: %d, 0 = disabled)", bparams.draft_tree });
     // draft model speculative decoding
     opts.push_back({ "speculative", "-md,   --model-draft FNAME",    "draft model for speculative decoding (default: unused)" });
     opts.push_back({ "speculative", "-td,   --threads-draft N",      "number of threads to use during generation (default: same as --threads)" });
@@ -1143,6 +1204,181 @@ static bool llama_box_params_parse(int argc, char **argv, llama_box_params &bpar
                 continue;
             }
 
+            if (!strcmp(flag, "--sched-policy")) { // extend
+                if (i == argc) {
+                    missing("--sched-policy");
+                }
+                char *arg = argv[i++];
+                if (strcmp(arg, "fcfs") != 0 && strcmp(arg, "sjf") != 0 && strcmp(arg, "priority") != 0) {
+                    invalid("--sched-policy");
+                }
+                bparams.sched_policy = std::string(arg);
+                continue;
+            }
+
+            if (!strcmp(flag, "--sched-max-wait")) { // extend
+                if (i == argc) {
+                    missing("--sched-max-wait");
+                }
+                char *arg = argv[i++];
+                bparams.sched_max_wait = std::stoi(std::string(arg));
+                if (bparams.sched_max_wait < 0) {
+                    invalid("--sched-max-wait");
+                }
+                continue;
+            }
+
+            if (!strcmp(flag, "--prefill-budget")) { // extend
+                if (i == argc) {
+                    missing("--prefill-budget");
+                }
+                char *arg = argv[i++];
+                bparams.prefill_budget = std::stoi(std::string(arg));
+                continue;
+            }
+
+            if (!strcmp(flag, "--max-queued")) { // extend
+                if (i == argc) {
+                    missing("--max-queued");
+                }
+                char *arg = argv[i++];
+                bparams.max_queued = std::stoi(std::string(arg));
+                continue;
+            }
+
+            if (!strcmp(flag, "--slo-ttft")) { // extend
+                if (i == argc) {
+                    missing("--slo-ttft");
+                }
+                char *arg = argv[i++];
+                bparams.slo_ttft = std::stoi(std::string(arg));
+                continue;
+            }
+
+            if (!strcmp(flag, "--elastic-ctx")) { // extend
+                bparams.elastic_ctx = true;
+                continue;
+            }
+
+            if (!strcmp(flag, "--prefix-cache-parked")) { // extend
+                if (i == argc) {
+                    missing("--prefix-cache-parked");
+                }
+                char *arg = argv[i++];
+                bparams.n_prefix_cache_parked = std::stoi(std::string(arg));
+                if (bparams.n_prefix_cache_parked < 0) {
+                    invalid("--prefix-cache-parked");
+                }
+                continue;
+            }
+
+            if (!strcmp(flag, "--prefix-cache-ram")) { // extend
+                if (i == argc) {
+                    missing("--prefix-cache-ram");
+                }
+                char *arg = argv[i++];
+                bparams.prefix_cache_ram = std::stoi(std::string(arg));
+                if (bparams.prefix_cache_ram < 0) {
+                    invalid("--prefix-cache-ram");
+                }
+                continue;
+            }
+
+            if (!strcmp(flag, "--prefix-cache-disk")) { // extend
+                if (i == argc) {
+                    missing("--prefix-cache-disk");
+                }
+                char *arg = argv[i++];
+                bparams.prefix_cache_disk = std::stoi(std::string(arg));
+                if (bparams.prefix_cache_disk < 0) {
+                    invalid("--prefix-cache-disk");
+                }
+                continue;
+            }
+
+            if (!strcmp(flag, "--named-prefixes")) { // extend
+                if (i == argc) {
+                    missing("--named-prefixes");
+                }
+                char *arg = argv[i++];
+                bparams.n_named_prefixes = std::stoi(std::string(arg));
+                if (bparams.n_named_prefixes < 0) {
+                    invalid("--named-prefixes");
+                }
+                continue;
+            }
+
+            if (!strcmp(flag, "--named-prefixes-ctx")) { // extend
+                if (i == argc) {
+                    missing("--named-prefixes-ctx");
+                }
+                char *arg = argv[i++];
+                bparams.named_prefixes_ctx = std::stoi(std::string(arg));
+                if (bparams.named_prefixes_ctx < 0) {
+                    invalid("--named-prefixes-ctx");
+                }
+                continue;
+            }
+
+            if (!strcmp(flag, "--slot-save-deltas")) { // extend
+                if (i == argc) {
+                    missing("--slot-save-deltas");
+                }
+                char *arg = argv[i++];
+                bparams.slot_save_deltas = std::stoi(std::string(arg));
+                if (bparams.slot_save_deltas < 0) {
+                    invalid("--slot-save-deltas");
+                }
+                continue;
+            }
+
+            if (!strcmp(flag, "--slot-save-quant")) { // extend
+                if (i == argc) {
+                    missing("--slot-save-quant");
+                }
+                char *arg = argv[i++];
+                bparams.slot_save_quant = std::string(arg);
+                if (bparams.slot_save_quant != "none" && bparams.slot_save_quant != "q8_0" &&
+                    bparams.slot_save_quant != "q4_0") {
+                    invalid("--slot-save-quant");
+                }
+                continue;
+            }
+
+            if (!strcmp(flag, "--pipeline")) { // extend
+                bparams.pipeline = true;
+                continue;
+            }
+
+            if (!strcmp(flag, "--output-thread")) { // extend
+                bparams.output_thread = true;
+                continue;
+            }
+
+            if (!strcmp(flag, "--chat-cache")) { // extend
+                if (i == argc) {
+                    missing("--chat-cache");
+                }
+                char *arg = argv[i++];
+                bparams.chat_cache = std::stoi(std::string(arg));
+                if (bparams.chat_cache < 0) {
+                    invalid("--chat-cache");
+                }
+                continue;
+            }
+
+            if (!strcmp(flag, "--tokenize-cache")) { // extend
+                if (i == argc) {
+                    missing("--tokenize-cache");
+                }
+                char *arg = argv[i++];
+                bparams.tokenize_cache = std::stoi(std::string(arg));
+                if (bparams.tokenize_cache < 0) {
+                    invalid("--tokenize-cache");
+                }
+                continue;
+            }
+
             // logging flags
 
             if (!strcmp(flag, "--log-format")) {
@@ -1171,6 +1407,23 @@ static bool llama_box_params_parse(int argc, char **argv, llama_box_params &bpar
                 continue;
             }
 
+            if (!strcmp(flag, "--draft-adaptive")) { // extend
+                bparams.draft_adaptive = true;
+                continue;
+            }
+
+            if (!strcmp(flag, "--draft-tree")) { // extend
+                if (i == argc) {
+                    missing("--draft-tree");
+                }
+                char *arg = argv[i++];
+                bparams.draft_tree = std::stoi(std::string(arg));
+                if (bparams.draft_tree < 0) {
+                    invalid("--draft-tree");
+                }
+                continue;
+            }
+
             if (!strcmp(flag, "-md") || !strcmp(flag, "--model-draft")) {
                 if (i == argc) {
                     missing("--model-draft");
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "llama.cpp/include/llama.h"
+
+// pieces of the whole vocabulary laid out in a flat byte arena, built once at load,
+// so that detokenizing a token is a lookup instead of a call into the model.
+class piece_table {
+
+  public:
+    enum piece_flag : uint8_t {
+        PIECE_FLAG_SPECIAL = 1, // rendered only if special tokens are asked for
+        PIECE_FLAG_BYTE = 2,    // a lone byte of a multibyte UTF-8 character
+    };
+
+  private:
+    // the piece is arena[offset:offset+n_piece], followed by the escaped form if it differs
+    struct entry {
+        uint32_t offset;
+        uint32_t n_piece;
+        uint32_t n_escaped;
+        uint8_t flags;
+    };
+
+    std::vector<char> arena;
+    std::vector<entry> entries;
+
+    static std::string render(const llama_model *model, llama_token token, bool special) {
+        char buf[128];
+        int32_t n = llama_token_to_piece(model, token, buf, sizeof(buf), 0, special);
+        if (n >= 0) {
+            return std::string(buf, n);
+        }
+        std::string piece(-n, '\0');
+        n = llama_token_to_piece(model, token, &piece[0], int32_t(piece.size()), 0, special);
+        piece.resize(n < 0 ? 0 : n);
+        return piece;
+    }
+
+  public:
+    void build(const llama_model *model) {
+        const int32_t n_vocab = llama_n_vocab(model);
+
+        arena.clear();
+        entries.clear();
+        entries.reserve(n_vocab);
+        for (llama_token token = 0; token < n_vocab; token++) {
+            const std::string piece = render(model, token, true);
+
+            entry e;
+            e.offset = uint32_t(arena.size());
+            e.n_piece = uint32_t(piece.size());
+            e.n_escaped = e.n_piece;
+            e.flags = 0;
+            arena.insert(arena.end(), piece.begin(), piece.end());
+
+            if (!piece.empty() && render(model, token, false).empty()) {
+                e.flags |= PIECE_FLAG_SPECIAL;
+            }
+            // size 1 with the first bit set means a partial character,
+            // larger ones are already known tokens
+            if (piece.size() == 1 && (piece[0] & 0x80) == 0x80) {
+                char escaped[16];
+                const int n = snprintf(escaped, sizeof(escaped), "byte: \\x%x", piece[0] & 0xff);
+                e.flags |= PIECE_FLAG_BYTE;
+                e.n_escaped = uint32_t(n);
+                arena.insert(arena.end(), escaped, escaped + n);
+            }
+
+            entries.push_back(e);
+        }
+        arena.shrink_to_fit();
+    }
+
+    size_t size() const {
+        return entries.size();
+    }
+
+    uint8_t flags(llama_token token) const {
+        return token < 0 || size_t(token) >= entries.size() ? 0 : entries[token].flags;
+    }
+
+    // append the piece of the token, the special tokens render as nothing unless asked for
+    void append(std::string &out, llama_token token, bool special) const {
+        if (token < 0 || size_t(token) >= entries.size()) {
+            return;
+        }
+        const entry &e = entries[token];
+        if (!special && (e.flags & PIECE_FLAG_SPECIAL)) {
+            return;
+        }
+        out.append(arena.data() + e.offset, e.n_piece);
+    }
+
+    // the piece of the token formatted for output, a lone byte is escaped as "byte: \xNN"
+    std::string escaped(llama_token token) const {
+        if (token < 0 || size_t(token) >= entries.size()) {
+            return std::string();
+        }
+        const entry &e = entries[token];
+        const uint32_t offset = (e.flags & PIECE_FLAG_BYTE) ? e.offset + e.n_piece : e.offset;
+        return std::string(arena.data() + offset, e.n_escaped);
+    }
+};
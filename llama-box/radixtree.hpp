@@ -0,0 +1,156 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// token-level radix tree of cached prefixes,
+// each owner (i.e. a KV sequence) registers the tokens it holds,
+// a node is kept as long as any owner passes through it.
+template <typename T> class radix_tree {
+
+  private:
+    struct node {
+        std::vector<T> edge;
+        std::map<T, std::unique_ptr<node>> children;
+        std::set<int32_t> owners;
+    };
+
+    node root;
+    std::unordered_map<int32_t, std::vector<T>> owned;
+
+    // split the node at the given offset of its edge,
+    // the node keeps the head and a new child takes the tail
+    static void split(node *n, size_t at) {
+        std::unique_ptr<node> tail(new node);
+        tail->edge.assign(n->edge.begin() + at, n->edge.end());
+        tail->children = std::move(n->children);
+        tail->owners = n->owners;
+        n->edge.resize(at);
+        n->children.clear();
+        const T key = tail->edge.front();
+        n->children[key] = std::move(tail);
+    }
+
+  public:
+    // register the tokens held by the owner, replacing the previous ones
+    void insert(int32_t owner, const std::vector<T> &tokens) {
+        erase(owner);
+        if (tokens.empty()) {
+            return;
+        }
+        owned[owner] = tokens;
+
+        node *n = &root;
+        size_t i = 0;
+        while (i < tokens.size()) {
+            auto it = n->children.find(tokens[i]);
+            if (it == n->children.end()) {
+                std::unique_ptr<node> leaf(new node);
+                leaf->edge.assign(tokens.begin() + i, tokens.end());
+                leaf->owners.insert(owner);
+                n->children[tokens[i]] = std::move(leaf);
+                return;
+            }
+            node *c = it->second.get();
+            size_t j = 0;
+            while (j < c->edge.size() && i + j < tokens.size() && c->edge[j] == tokens[i + j]) {
+                j++;
+            }
+            if (j < c->edge.size()) {
+                split(c, j);
+            }
+            c->owners.insert(owner);
+            n = c;
+            i += j;
+        }
+    }
+
+    // unregister the owner, prune the nodes no one passes through
+    void erase(int32_t owner) {
+        auto it = owned.find(owner);
+        if (it == owned.end()) {
+            return;
+        }
+        const std::vector<T> tokens = std::move(it->second);
+        owned.erase(it);
+
+        node *n = &root;
+        size_t i = 0;
+        while (i < tokens.size()) {
+            auto ct = n->children.find(tokens[i]);
+            if (ct == n->children.end()) {
+                return;
+            }
+            node *c = ct->second.get();
+            c->owners.erase(owner);
+            if (c->owners.empty()) {
+                n->children.erase(ct);
+                return;
+            }
+            n = c;
+            i += c->edge.size();
+        }
+    }
+
+    // unregister all owners
+    void clear() {
+        root.children.clear();
+        owned.clear();
+    }
+
+    // check if the owner is registered
+    bool contains(int32_t owner) const {
+        return owned.find(owner) != owned.end();
+    }
+
+    // get the tokens held by the owner
+    const std::vector<T> &get(int32_t owner) const {
+        static const std::vector<T> empty;
+        auto it = owned.find(owner);
+        return it == owned.end() ? empty : it->second;
+    }
+
+    // find the owner holding the longest prefix of the tokens,
+    // the filter can exclude owners, returns {-1, 0} if nothing matches
+    template <typename F>
+    std::pair<int32_t, size_t> longest_prefix(const std::vector<T> &tokens, F filter) const {
+        std::pair<int32_t, size_t> ret = {-1, 0};
+
+        const node *n = &root;
+        size_t i = 0;
+        while (i < tokens.size()) {
+            auto it = n->children.find(tokens[i]);
+            if (it == n->children.end()) {
+                break;
+            }
+            const node *c = it->second.get();
+            size_t j = 0;
+            while (j < c->edge.size() && i + j < tokens.size() && c->edge[j] == tokens[i + j]) {
+                j++;
+            }
+            int32_t owner = -1;
+            for (const int32_t o : c->owners) {
+                if (filter(o)) {
+                    owner = o;
+                    break;
+                }
+            }
+            if (owner == -1) {
+                break;
+            }
+            ret = {owner, i + j};
+            if (j < c->edge.size()) {
+                break;
+            }
+            n = c;
+            i += j;
+        }
+
+        return ret;
+    }
+};
@@ -32,6 +32,11 @@ class token_bucket {
         last_time = std::chrono::steady_clock::now();
     }
 
+    // the time of the next refill
+    std::chrono::steady_clock::time_point next_refill() const {
+        return last_time + std::chrono::seconds(1);
+    }
+
     bool acquire(int tokens = 1) {
         if (this->tokens_remain < tokens) {
             refill();
@@ -0,0 +1,131 @@
+// benchmark of the task queue of the server: producers post tasks while the consumer drains
+// them, the mutex-guarded vector popped from the front the queue used to be, against the
+// lockless ring buffer it is now.
+//
+// usage: llama-box-bench-ringbuffer [n_tasks [n_producers [n_rounds]]]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ringbuffer.hpp"
+
+// moved through the queue like a server task, i.e. with some heap data
+struct bench_task {
+    int id = -1;
+    std::string data;
+};
+
+// the previous queue: every post and pop takes the mutex, and pops erase the front
+class vector_queue {
+  private:
+    std::mutex mutex;
+    std::vector<bench_task> tasks;
+
+  public:
+    bool push(bench_task &&v) {
+        std::unique_lock<std::mutex> lock(mutex);
+        tasks.push_back(std::move(v));
+        return true;
+    }
+
+    bool pop(bench_task &v) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (tasks.empty()) {
+            return false;
+        }
+        v = std::move(tasks.front());
+        tasks.erase(tasks.begin());
+        return true;
+    }
+};
+
+struct bench_result {
+    double t_total = 0; // us to post and drain all tasks
+    double t_post = 0;  // ns per post, averaged over the producers
+    double t_pop = 0;   // ns per successful pop
+};
+
+// the producers post n_tasks in total, the consumer pops until it got them all,
+// posting all first, so that the consumer faces n_tasks queued
+template <typename Q> static bench_result bench(Q &queue, int n_tasks, int n_producers) {
+    typedef std::chrono::steady_clock clock;
+    const auto us = [](clock::duration d) {
+        return double(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count()) / 1e3;
+    };
+
+    bench_result res;
+    std::vector<double> t_posts(n_producers, 0);
+    std::vector<std::thread> producers;
+    const clock::time_point t_start = clock::now();
+    for (int p = 0; p < n_producers; p++) {
+        producers.emplace_back([&queue, &t_posts, &us, p, n_tasks, n_producers]() {
+            const clock::time_point t0 = clock::now();
+            for (int i = p; i < n_tasks; i += n_producers) {
+                bench_task task;
+                task.id = i;
+                task.data = "prompt of the task";
+                while (!queue.push(std::move(task))) {
+                    std::this_thread::yield();
+                }
+            }
+            const int n = (n_tasks - p + n_producers - 1) / n_producers;
+            t_posts[p] = n > 0 ? 1e3 * us(clock::now() - t0) / n : 0;
+        });
+    }
+    for (std::thread &t : producers) {
+        t.join();
+    }
+
+    const clock::time_point t_drain = clock::now();
+    bench_task task;
+    for (int n = 0; n < n_tasks;) {
+        if (queue.pop(task)) {
+            n++;
+        }
+    }
+    const clock::time_point t_end = clock::now();
+
+    res.t_total = us(t_end - t_start);
+    for (double t : t_posts) {
+        res.t_post += t / n_producers;
+    }
+    res.t_pop = 1e3 * us(t_end - t_drain) / n_tasks;
+    return res;
+}
+
+int main(int argc, char **argv) {
+    const int n_tasks = argc > 1 ? std::atoi(argv[1]) : 4096;
+    const int n_producers = argc > 2 ? std::atoi(argv[2]) : 4;
+    const int n_rounds = argc > 3 ? std::atoi(argv[3]) : 50;
+    if (n_tasks <= 0 || n_producers <= 0 || n_rounds <= 0) {
+        fprintf(stderr, "usage: %s [n_tasks [n_producers [n_rounds]]]\n", argv[0]);
+        return 1;
+    }
+
+    bench_result vec;
+    bench_result ring;
+    for (int r = 0; r < n_rounds; r++) {
+        vector_queue vq;
+        const bench_result v = bench(vq, n_tasks, n_producers);
+        // sized like the server queue, at least the tasks of a round
+        mpsc_ring_buffer<bench_task> rq(n_tasks > 4096 ? size_t(n_tasks) : 4096);
+        const bench_result q = bench(rq, n_tasks, n_producers);
+        vec.t_total += v.t_total / n_rounds;
+        vec.t_post += v.t_post / n_rounds;
+        vec.t_pop += v.t_pop / n_rounds;
+        ring.t_total += q.t_total / n_rounds;
+        ring.t_post += q.t_post / n_rounds;
+        ring.t_pop += q.t_pop / n_rounds;
+    }
+
+    printf("%d tasks, %d producers, %d rounds\n", n_tasks, n_producers, n_rounds);
+    printf("%-14s %12s %12s %12s\n", "queue", "total (us)", "post (ns)", "pop (ns)");
+    printf("%-14s %12.1f %12.1f %12.1f\n", "vector+mutex", vec.t_total, vec.t_post, vec.t_pop);
+    printf("%-14s %12.1f %12.1f %12.1f\n", "ring", ring.t_total, ring.t_post, ring.t_pop);
+    return 0;
+}
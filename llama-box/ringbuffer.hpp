@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+// lockless bounded multi-producer/single-consumer ring buffer,
+// each cell carries a sequence number to tell producers and the consumer
+// whether it is free, being written or ready to be read.
+template <typename T> class mpsc_ring_buffer {
+
+  private:
+    struct cell {
+        std::atomic<size_t> seq;
+        T data;
+    };
+
+    size_t mask;
+    std::unique_ptr<cell[]> buffer;
+
+    // written by producers
+    std::atomic<size_t> enqueue_pos;
+    // only touched by the consumer
+    size_t dequeue_pos;
+
+  public:
+    // capacity is rounded up to the next power of two
+    explicit mpsc_ring_buffer(size_t capacity) {
+        size_t n = 2;
+        while (n < capacity) {
+            n <<= 1;
+        }
+        mask = n - 1;
+        buffer.reset(new cell[n]);
+        for (size_t i = 0; i < n; i++) {
+            buffer[i].seq.store(i, std::memory_order_relaxed);
+        }
+        enqueue_pos.store(0, std::memory_order_relaxed);
+        dequeue_pos = 0;
+    }
+
+    mpsc_ring_buffer(const mpsc_ring_buffer &) = delete;
+    mpsc_ring_buffer &operator=(const mpsc_ring_buffer &) = delete;
+
+    size_t capacity() const {
+        return mask + 1;
+    }
+
+    // push an item, returns false if the ring is full,
+    // safe to call from any thread
+    bool push(T &&v) {
+        cell *c;
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            c = &buffer[pos & mask];
+            const size_t seq = c->seq.load(std::memory_order_acquire);
+            const intptr_t diff = intptr_t(seq) - intptr_t(pos);
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        c->data = std::move(v);
+        c->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // pop an item, returns false if the ring is empty,
+    // must only be called from the consumer thread
+    bool pop(T &v) {
+        cell *c = &buffer[dequeue_pos & mask];
+        const size_t seq = c->seq.load(std::memory_order_acquire);
+        if (intptr_t(seq) - intptr_t(dequeue_pos + 1) < 0) {
+            return false;
+        }
+        v = std::move(c->data);
+        c->data = T();
+        c->seq.store(dequeue_pos + mask + 1, std::memory_order_release);
+        dequeue_pos++;
+        return true;
+    }
+
+    // check if there is nothing ready to pop,
+    // must only be called from the consumer thread
+    bool empty() const {
+        const cell *c = &buffer[dequeue_pos & mask];
+        const size_t seq = c->seq.load(std::memory_order_acquire);
+        return intptr_t(seq) - intptr_t(dequeue_pos + 1) < 0;
+    }
+};
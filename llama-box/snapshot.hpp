@@ -0,0 +1,555 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "llama.cpp/include/llama.h"
+
+#include "hash.hpp"
+
+// on-disk snapshot of a cached prefix,
+// layout: magic, version, n_tokens, tokens, n_data, data.
+
+#define SNAPSHOT_MAGIC 0x4C425053u // LBPS
+#define SNAPSHOT_VERSION 1u
+
+// FNV-1a hash of a token sequence, can be computed incrementally
+static uint64_t snapshot_hash_init() {
+    return FNV1A_SEED;
+}
+
+static uint64_t snapshot_hash_step(uint64_t h, llama_token tok) {
+    const auto v = uint32_t(tok);
+    for (int i = 0; i < 4; i++) {
+        h = fnv1a(h, uint8_t(v >> (i * 8)));
+    }
+    return h;
+}
+
+static uint64_t snapshot_hash(const std::vector<llama_token> &tokens) {
+    uint64_t h = snapshot_hash_init();
+    for (const llama_token tok : tokens) {
+        h = snapshot_hash_step(h, tok);
+    }
+    return h;
+}
+
+static bool snapshot_write(const std::string &path, const std::vector<llama_token> &tokens,
+                           const std::vector<uint8_t> &data) {
+    std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+    if (!ofs) {
+        return false;
+    }
+    const uint32_t magic = SNAPSHOT_MAGIC;
+    const uint32_t version = SNAPSHOT_VERSION;
+    const auto n_tokens = uint32_t(tokens.size());
+    const auto n_data = uint64_t(data.size());
+    ofs.write(reinterpret_cast<const char *>(&magic), sizeof(magic));
+    ofs.write(reinterpret_cast<const char *>(&version), sizeof(version));
+    ofs.write(reinterpret_cast<const char *>(&n_tokens), sizeof(n_tokens));
+    ofs.write(reinterpret_cast<const char *>(tokens.data()), n_tokens * sizeof(llama_token));
+    ofs.write(reinterpret_cast<const char *>(&n_data), sizeof(n_data));
+    ofs.write(reinterpret_cast<const char *>(data.data()), std::streamsize(n_data));
+    return bool(ofs);
+}
+
+static bool snapshot_read(const std::string &path, std::vector<llama_token> &tokens,
+                          std::vector<uint8_t> &data) {
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs) {
+        return false;
+    }
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    uint32_t n_tokens = 0;
+    uint64_t n_data = 0;
+    ifs.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+    ifs.read(reinterpret_cast<char *>(&version), sizeof(version));
+    if (!ifs || magic != SNAPSHOT_MAGIC || version != SNAPSHOT_VERSION) {
+        return false;
+    }
+    ifs.read(reinterpret_cast<char *>(&n_tokens), sizeof(n_tokens));
+    tokens.resize(n_tokens);
+    ifs.read(reinterpret_cast<char *>(tokens.data()), n_tokens * sizeof(llama_token));
+    ifs.read(reinterpret_cast<char *>(&n_data), sizeof(n_data));
+    if (!ifs) {
+        return false;
+    }
+    data.resize(n_data);
+    ifs.read(reinterpret_cast<char *>(data.data()), std::streamsize(n_data));
+    return bool(ifs);
+}
+
+static uint64_t snapshot_hash_bytes(uint64_t h, const void *data, size_t n) {
+    return fnv1a(h, data, n);
+}
+
+// quantization of the K/V data in a sequence state as written by llama_state_seq_get_data,
+// the f16/f32 data of each layer is quantized in blocks of 32 values and everything else is
+// kept as is, so that the quantized state can be walked the same way to restore it.
+
+enum slot_snapshot_quant {
+    SLOT_SNAPSHOT_QUANT_NONE = 0,
+    SLOT_SNAPSHOT_QUANT_Q8_0 = 1,
+    SLOT_SNAPSHOT_QUANT_Q4_0 = 2,
+};
+
+#define SLOT_SNAPSHOT_QK 32
+
+static size_t slot_snapshot_block_size(slot_snapshot_quant quant) {
+    return sizeof(ggml_fp16_t) + (quant == SLOT_SNAPSHOT_QUANT_Q8_0 ? SLOT_SNAPSHOT_QK
+                                                                    : SLOT_SNAPSHOT_QK / 2);
+}
+
+// quantize n (<= 32) values, the rest of the block is zero
+static void slot_snapshot_quantize_block(const float *x, size_t n, slot_snapshot_quant quant,
+                                         uint8_t *dst) {
+    float amax = 0.0f;
+    float max = 0.0f;
+    for (size_t i = 0; i < n; i++) {
+        if (std::fabs(x[i]) > amax) {
+            amax = std::fabs(x[i]);
+            max = x[i];
+        }
+    }
+    const float d = quant == SLOT_SNAPSHOT_QUANT_Q8_0 ? amax / 127.0f : max / -8.0f;
+    const float id = d != 0.0f ? 1.0f / d : 0.0f;
+    const ggml_fp16_t dh = ggml_fp32_to_fp16(d);
+    std::memcpy(dst, &dh, sizeof(dh));
+    uint8_t *qs = dst + sizeof(dh);
+    if (quant == SLOT_SNAPSHOT_QUANT_Q8_0) {
+        for (size_t i = 0; i < SLOT_SNAPSHOT_QK; i++) {
+            qs[i] = uint8_t(int8_t(i < n ? std::round(x[i] * id) : 0.0f));
+        }
+        return;
+    }
+    for (size_t j = 0; j < SLOT_SNAPSHOT_QK / 2; j++) {
+        const float x0 = j < n ? x[j] * id : 0.0f;
+        const float x1 = j + SLOT_SNAPSHOT_QK / 2 < n ? x[j + SLOT_SNAPSHOT_QK / 2] * id : 0.0f;
+        const auto q0 = uint8_t(std::min(15, int(x0 + 8.5f)));
+        const auto q1 = uint8_t(std::min(15, int(x1 + 8.5f)));
+        qs[j] = uint8_t(q0 | (q1 << 4));
+    }
+}
+
+// dequantize the first n (<= 32) values of the block
+static void slot_snapshot_dequantize_block(const uint8_t *src, size_t n, slot_snapshot_quant quant,
+                                           float *y) {
+    ggml_fp16_t dh;
+    std::memcpy(&dh, src, sizeof(dh));
+    const float d = ggml_fp16_to_fp32(dh);
+    const uint8_t *qs = src + sizeof(dh);
+    for (size_t i = 0; i < n; i++) {
+        if (quant == SLOT_SNAPSHOT_QUANT_Q8_0) {
+            y[i] = float(int8_t(qs[i])) * d;
+        } else if (i < SLOT_SNAPSHOT_QK / 2) {
+            y[i] = float(int(qs[i] & 0x0F) - 8) * d;
+        } else {
+            y[i] = float(int(qs[i - SLOT_SNAPSHOT_QK / 2] >> 4) - 8) * d;
+        }
+    }
+}
+
+// walk the sequence state and (de)quantize its data, returns false if the state is malformed
+static bool slot_snapshot_transcode(const std::vector<uint8_t> &src, slot_snapshot_quant quant,
+                                    bool restore, std::vector<uint8_t> &dst) {
+    dst.clear();
+    dst.reserve(restore ? src.size() * 4 : src.size() / 2);
+    size_t off = 0;
+
+    // copy as is
+    auto copy = [&](size_t n) -> bool {
+        if (n > src.size() - off) {
+            return false;
+        }
+        dst.insert(dst.end(), src.begin() + off, src.begin() + off + n);
+        off += n;
+        return true;
+    };
+    // copy as is and take the value
+    auto field = [&](void *v, size_t n) -> bool {
+        if (n > src.size() - off) {
+            return false;
+        }
+        std::memcpy(v, src.data() + off, n);
+        return copy(n);
+    };
+    // (de)quantize the data of n_bytes in its original type
+    auto region = [&](int32_t type, uint64_t n_bytes) -> bool {
+        size_t n_el = 0;
+        if (type == GGML_TYPE_F16) {
+            n_el = sizeof(ggml_fp16_t);
+        } else if (type == GGML_TYPE_F32) {
+            n_el = sizeof(float);
+        }
+        if (n_el == 0 || n_bytes % n_el != 0) {
+            return copy(n_bytes);
+        }
+        const size_t n = n_bytes / n_el;
+        const size_t n_blocks = (n + SLOT_SNAPSHOT_QK - 1) / SLOT_SNAPSHOT_QK;
+        const size_t n_block_bytes = slot_snapshot_block_size(quant);
+        float buf[SLOT_SNAPSHOT_QK];
+        if (!restore) {
+            if (n_bytes > src.size() - off) {
+                return false;
+            }
+            const size_t o = dst.size();
+            dst.resize(o + n_blocks * n_block_bytes);
+            for (size_t b = 0; b < n_blocks; b++) {
+                const size_t nb = std::min(size_t(SLOT_SNAPSHOT_QK), n - b * SLOT_SNAPSHOT_QK);
+                const uint8_t *x = src.data() + off + b * SLOT_SNAPSHOT_QK * n_el;
+                for (size_t i = 0; i < nb; i++) {
+                    if (type == GGML_TYPE_F16) {
+                        ggml_fp16_t h;
+                        std::memcpy(&h, x + i * n_el, n_el);
+                        buf[i] = ggml_fp16_to_fp32(h);
+                    } else {
+                        std::memcpy(&buf[i], x + i * n_el, n_el);
+                    }
+                }
+                slot_snapshot_quantize_block(buf, nb, quant, dst.data() + o + b * n_block_bytes);
+            }
+            off += n_bytes;
+        } else {
+            if (n_blocks * n_block_bytes > src.size() - off) {
+                return false;
+            }
+            const size_t o = dst.size();
+            dst.resize(o + n_bytes);
+            for (size_t b = 0; b < n_blocks; b++) {
+                const size_t nb = std::min(size_t(SLOT_SNAPSHOT_QK), n - b * SLOT_SNAPSHOT_QK);
+                slot_snapshot_dequantize_block(src.data() + off + b * n_block_bytes, nb, quant,
+                                               buf);
+                uint8_t *y = dst.data() + o + b * SLOT_SNAPSHOT_QK * n_el;
+                for (size_t i = 0; i < nb; i++) {
+                    if (type == GGML_TYPE_F16) {
+                        const ggml_fp16_t h = ggml_fp32_to_fp16(buf[i]);
+                        std::memcpy(y + i * n_el, &h, n_el);
+                    } else {
+                        std::memcpy(y + i * n_el, &buf[i], n_el);
+                    }
+                }
+            }
+            off += n_blocks * n_block_bytes;
+        }
+        return true;
+    };
+
+    // cells
+    uint32_t cell_count = 0;
+    if (!field(&cell_count, sizeof(cell_count))) {
+        return false;
+    }
+    for (uint32_t i = 0; i < cell_count; i++) {
+        llama_pos pos;
+        uint32_t n_seq_id;
+        if (!field(&pos, sizeof(pos)) || !field(&n_seq_id, sizeof(n_seq_id)) ||
+            !copy(size_t(n_seq_id) * sizeof(llama_seq_id))) {
+            return false;
+        }
+    }
+
+    // layers
+    uint32_t v_trans = 0;
+    uint32_t n_layer = 0;
+    if (!field(&v_trans, sizeof(v_trans)) || !field(&n_layer, sizeof(n_layer))) {
+        return false;
+    }
+    for (uint32_t il = 0; il < n_layer; il++) {
+        int32_t k_type;
+        uint64_t k_size_row;
+        if (!field(&k_type, sizeof(k_type)) || !field(&k_size_row, sizeof(k_size_row)) ||
+            !region(k_type, cell_count * k_size_row)) {
+            return false;
+        }
+    }
+    for (uint32_t il = 0; il < n_layer; il++) {
+        int32_t v_type;
+        if (!field(&v_type, sizeof(v_type))) {
+            return false;
+        }
+        if (!v_trans) {
+            uint64_t v_size_row;
+            if (!field(&v_size_row, sizeof(v_size_row)) ||
+                !region(v_type, cell_count * v_size_row)) {
+                return false;
+            }
+        } else {
+            uint32_t v_size_el;
+            uint32_t n_embd_v_gqa;
+            if (!field(&v_size_el, sizeof(v_size_el)) ||
+                !field(&n_embd_v_gqa, sizeof(n_embd_v_gqa)) ||
+                !region(v_type, uint64_t(n_embd_v_gqa) * cell_count * v_size_el)) {
+                return false;
+            }
+        }
+    }
+
+    return off == src.size();
+}
+
+// encode the state for the file, falls back to no quantization if the state can't be walked
+static slot_snapshot_quant slot_snapshot_encode(const std::vector<uint8_t> &data,
+                                                slot_snapshot_quant quant,
+                                                std::vector<uint8_t> &out) {
+    if (quant != SLOT_SNAPSHOT_QUANT_NONE && slot_snapshot_transcode(data, quant, false, out)) {
+        return quant;
+    }
+    out = data;
+    return SLOT_SNAPSHOT_QUANT_NONE;
+}
+
+static bool slot_snapshot_decode(std::vector<uint8_t> &&in, slot_snapshot_quant quant,
+                                 std::vector<uint8_t> &data) {
+    if (quant == SLOT_SNAPSHOT_QUANT_NONE) {
+        data = std::move(in);
+        return true;
+    }
+    if (quant != SLOT_SNAPSHOT_QUANT_Q8_0 && quant != SLOT_SNAPSHOT_QUANT_Q4_0) {
+        return false;
+    }
+    return slot_snapshot_transcode(in, quant, true, data);
+}
+
+// slot snapshot, without quantization it is in the layout of llama_state_seq_save_file,
+// so that the files stay interchangeable with llama_state_seq_load_file:
+//   magic, version, n_tokens, tokens, data.
+// with quantization:
+//   magic, version, quant, model fingerprint, n_tokens, tokens, n_data, checksum, data,
+//   the checksum covers the tokens and the data.
+
+#define SLOT_SNAPSHOT_QUANT_MAGIC 0x4C425153u // LBQS
+#define SLOT_SNAPSHOT_QUANT_VERSION 1u
+
+// write the staged state of a slot, returns the bytes written or 0 on failure
+static size_t slot_snapshot_write(const std::string &path, const std::vector<llama_token> &tokens,
+                                  const std::vector<uint8_t> &data, slot_snapshot_quant quant,
+                                  uint64_t fingerprint) {
+    std::vector<uint8_t> encoded;
+    if (quant != SLOT_SNAPSHOT_QUANT_NONE) {
+        quant = slot_snapshot_encode(data, quant, encoded);
+    }
+
+    std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+    if (!ofs) {
+        return 0;
+    }
+    const auto n_tokens = uint32_t(tokens.size());
+    size_t n_written = 0;
+    if (quant == SLOT_SNAPSHOT_QUANT_NONE) {
+        const uint32_t magic = LLAMA_STATE_SEQ_MAGIC;
+        const uint32_t version = LLAMA_STATE_SEQ_VERSION;
+        ofs.write(reinterpret_cast<const char *>(&magic), sizeof(magic));
+        ofs.write(reinterpret_cast<const char *>(&version), sizeof(version));
+        ofs.write(reinterpret_cast<const char *>(&n_tokens), sizeof(n_tokens));
+        ofs.write(reinterpret_cast<const char *>(tokens.data()), n_tokens * sizeof(llama_token));
+        ofs.write(reinterpret_cast<const char *>(data.data()), std::streamsize(data.size()));
+        n_written = 3 * sizeof(uint32_t) + n_tokens * sizeof(llama_token) + data.size();
+    } else {
+        const uint32_t magic = SLOT_SNAPSHOT_QUANT_MAGIC;
+        const uint32_t version = SLOT_SNAPSHOT_QUANT_VERSION;
+        const auto q = uint32_t(quant);
+        const auto n_data = uint64_t(encoded.size());
+        uint64_t checksum = snapshot_hash_init();
+        checksum = snapshot_hash_bytes(checksum, tokens.data(), n_tokens * sizeof(llama_token));
+        checksum = snapshot_hash_bytes(checksum, encoded.data(), encoded.size());
+        ofs.write(reinterpret_cast<const char *>(&magic), sizeof(magic));
+        ofs.write(reinterpret_cast<const char *>(&version), sizeof(version));
+        ofs.write(reinterpret_cast<const char *>(&q), sizeof(q));
+        ofs.write(reinterpret_cast<const char *>(&fingerprint), sizeof(fingerprint));
+        ofs.write(reinterpret_cast<const char *>(&n_tokens), sizeof(n_tokens));
+        ofs.write(reinterpret_cast<const char *>(tokens.data()), n_tokens * sizeof(llama_token));
+        ofs.write(reinterpret_cast<const char *>(&n_data), sizeof(n_data));
+        ofs.write(reinterpret_cast<const char *>(&checksum), sizeof(checksum));
+        ofs.write(reinterpret_cast<const char *>(encoded.data()), std::streamsize(n_data));
+        n_written = 4 * sizeof(uint32_t) + 3 * sizeof(uint64_t) + n_tokens * sizeof(llama_token) +
+                    encoded.size();
+    }
+    if (!ofs) {
+        return 0;
+    }
+    return n_written;
+}
+
+// read the state of a slot to stage, returns the bytes read or 0 on failure,
+// a quantized snapshot must come from the model of the same fingerprint
+static size_t slot_snapshot_read(const std::string &path, size_t n_tokens_max,
+                                 uint64_t fingerprint, std::vector<llama_token> &tokens,
+                                 std::vector<uint8_t> &data) {
+    std::ifstream ifs(path, std::ios::binary | std::ios::ate);
+    if (!ifs) {
+        return 0;
+    }
+    const auto n_file = size_t(ifs.tellg());
+    ifs.seekg(0);
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    ifs.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+    ifs.read(reinterpret_cast<char *>(&version), sizeof(version));
+    if (!ifs) {
+        return 0;
+    }
+
+    if (magic == LLAMA_STATE_SEQ_MAGIC && version == LLAMA_STATE_SEQ_VERSION) {
+        uint32_t n_tokens = 0;
+        ifs.read(reinterpret_cast<char *>(&n_tokens), sizeof(n_tokens));
+        const size_t n_head = 3 * sizeof(uint32_t) + size_t(n_tokens) * sizeof(llama_token);
+        if (!ifs || n_tokens > n_tokens_max || n_file < n_head) {
+            return 0;
+        }
+        tokens.resize(n_tokens);
+        ifs.read(reinterpret_cast<char *>(tokens.data()), n_tokens * sizeof(llama_token));
+        data.resize(n_file - n_head);
+        ifs.read(reinterpret_cast<char *>(data.data()), std::streamsize(data.size()));
+        return ifs ? n_file : 0;
+    }
+
+    if (magic != SLOT_SNAPSHOT_QUANT_MAGIC || version != SLOT_SNAPSHOT_QUANT_VERSION) {
+        return 0;
+    }
+    uint32_t quant = 0;
+    uint64_t file_fingerprint = 0;
+    uint32_t n_tokens = 0;
+    uint64_t n_data = 0;
+    uint64_t checksum = 0;
+    ifs.read(reinterpret_cast<char *>(&quant), sizeof(quant));
+    ifs.read(reinterpret_cast<char *>(&file_fingerprint), sizeof(file_fingerprint));
+    ifs.read(reinterpret_cast<char *>(&n_tokens), sizeof(n_tokens));
+    if (!ifs || file_fingerprint != fingerprint || n_tokens > n_tokens_max) {
+        return 0;
+    }
+    tokens.resize(n_tokens);
+    ifs.read(reinterpret_cast<char *>(tokens.data()), n_tokens * sizeof(llama_token));
+    ifs.read(reinterpret_cast<char *>(&n_data), sizeof(n_data));
+    ifs.read(reinterpret_cast<char *>(&checksum), sizeof(checksum));
+    if (!ifs || n_data > n_file - size_t(ifs.tellg())) {
+        return 0;
+    }
+    std::vector<uint8_t> encoded(n_data);
+    ifs.read(reinterpret_cast<char *>(encoded.data()), std::streamsize(n_data));
+    if (!ifs) {
+        return 0;
+    }
+    uint64_t h = snapshot_hash_init();
+    h = snapshot_hash_bytes(h, tokens.data(), n_tokens * sizeof(llama_token));
+    h = snapshot_hash_bytes(h, encoded.data(), encoded.size());
+    if (h != checksum ||
+        !slot_snapshot_decode(std::move(encoded), slot_snapshot_quant(quant), data)) {
+        return 0;
+    }
+    return n_file;
+}
+
+// appended segment of an incremental slot snapshot, kept in a side file next to the base,
+// layout: magic, version, p0, quant, n_tokens, tokens, n_data, checksum, data,
+// p0 is the index of the first token, i.e. the number of tokens before the segment.
+
+#define SLOT_SNAPSHOT_DELTA_MAGIC 0x4C425344u // LBSD
+#define SLOT_SNAPSHOT_DELTA_VERSION 2u
+
+struct slot_snapshot_delta {
+    uint32_t p0 = 0;
+    std::vector<llama_token> tokens;
+    std::vector<uint8_t> data;
+};
+
+static std::string slot_snapshot_delta_path(const std::string &path) {
+    return path + ".delta";
+}
+
+// append a segment, returns the bytes written or 0 on failure
+static size_t slot_snapshot_append_delta(const std::string &path,
+                                         const slot_snapshot_delta &delta,
+                                         slot_snapshot_quant quant) {
+    std::vector<uint8_t> encoded;
+    quant = slot_snapshot_encode(delta.data, quant, encoded);
+
+    std::ofstream ofs(slot_snapshot_delta_path(path), std::ios::binary | std::ios::app);
+    if (!ofs) {
+        return 0;
+    }
+    const uint32_t magic = SLOT_SNAPSHOT_DELTA_MAGIC;
+    const uint32_t version = SLOT_SNAPSHOT_DELTA_VERSION;
+    const auto q = uint32_t(quant);
+    const auto n_tokens = uint32_t(delta.tokens.size());
+    const auto n_data = uint64_t(encoded.size());
+    uint64_t checksum = snapshot_hash_init();
+    checksum = snapshot_hash_bytes(checksum, delta.tokens.data(), n_tokens * sizeof(llama_token));
+    checksum = snapshot_hash_bytes(checksum, encoded.data(), encoded.size());
+    ofs.write(reinterpret_cast<const char *>(&magic), sizeof(magic));
+    ofs.write(reinterpret_cast<const char *>(&version), sizeof(version));
+    ofs.write(reinterpret_cast<const char *>(&delta.p0), sizeof(delta.p0));
+    ofs.write(reinterpret_cast<const char *>(&q), sizeof(q));
+    ofs.write(reinterpret_cast<const char *>(&n_tokens), sizeof(n_tokens));
+    ofs.write(reinterpret_cast<const char *>(delta.tokens.data()), n_tokens * sizeof(llama_token));
+    ofs.write(reinterpret_cast<const char *>(&n_data), sizeof(n_data));
+    ofs.write(reinterpret_cast<const char *>(&checksum), sizeof(checksum));
+    ofs.write(reinterpret_cast<const char *>(encoded.data()), std::streamsize(n_data));
+    if (!ofs) {
+        return 0;
+    }
+    return 5 * sizeof(uint32_t) + n_tokens * sizeof(llama_token) + 2 * sizeof(uint64_t) + n_data;
+}
+
+// read the segments following n_base tokens, stops at the first broken or discontinuous one,
+// returns the bytes read
+static size_t slot_snapshot_read_deltas(const std::string &path, size_t n_base,
+                                        size_t n_tokens_max,
+                                        std::vector<slot_snapshot_delta> &deltas) {
+    std::ifstream ifs(slot_snapshot_delta_path(path), std::ios::binary | std::ios::ate);
+    if (!ifs) {
+        return 0;
+    }
+    const auto n_file = size_t(ifs.tellg());
+    ifs.seekg(0);
+    size_t n_read = 0;
+    size_t n_tokens_total = n_base;
+    while (true) {
+        uint32_t magic = 0;
+        uint32_t version = 0;
+        uint32_t quant = 0;
+        uint32_t n_tokens = 0;
+        uint64_t n_data = 0;
+        uint64_t checksum = 0;
+        slot_snapshot_delta delta;
+        ifs.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+        ifs.read(reinterpret_cast<char *>(&version), sizeof(version));
+        ifs.read(reinterpret_cast<char *>(&delta.p0), sizeof(delta.p0));
+        ifs.read(reinterpret_cast<char *>(&quant), sizeof(quant));
+        ifs.read(reinterpret_cast<char *>(&n_tokens), sizeof(n_tokens));
+        if (!ifs || magic != SLOT_SNAPSHOT_DELTA_MAGIC ||
+            version != SLOT_SNAPSHOT_DELTA_VERSION || delta.p0 != n_tokens_total ||
+            n_tokens_total + n_tokens > n_tokens_max) {
+            break;
+        }
+        delta.tokens.resize(n_tokens);
+        ifs.read(reinterpret_cast<char *>(delta.tokens.data()), n_tokens * sizeof(llama_token));
+        ifs.read(reinterpret_cast<char *>(&n_data), sizeof(n_data));
+        ifs.read(reinterpret_cast<char *>(&checksum), sizeof(checksum));
+        if (!ifs || n_data > n_file - size_t(ifs.tellg())) {
+            break;
+        }
+        std::vector<uint8_t> encoded(n_data);
+        ifs.read(reinterpret_cast<char *>(encoded.data()), std::streamsize(n_data));
+        if (!ifs) {
+            break;
+        }
+        uint64_t h = snapshot_hash_init();
+        h = snapshot_hash_bytes(h, delta.tokens.data(), n_tokens * sizeof(llama_token));
+        h = snapshot_hash_bytes(h, encoded.data(), encoded.size());
+        if (h != checksum ||
+            !slot_snapshot_decode(std::move(encoded), slot_snapshot_quant(quant), delta.data)) {
+            break;
+        }
+        n_read += 5 * sizeof(uint32_t) + n_tokens * sizeof(llama_token) + 2 * sizeof(uint64_t) +
+                  n_data;
+        n_tokens_total += n_tokens;
+        deltas.push_back(std::move(delta));
+    }
+    return n_read;
+}
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Aho-Corasick automaton over a set of words, fed incrementally with the symbols of a stream,
+// e.g. the bytes of the generated text or the ids of the generated tokens.
+// positions are counted from the first symbol fed since the last reset.
+template <typename T> class stop_matcher {
+
+  private:
+    struct node {
+        std::vector<std::pair<T, int32_t>> next;
+        int32_t fail = 0;
+        int32_t out = -1;  // nearest node on the fail chain ending a word
+        int32_t word = -1; // word ending at this node
+        size_t depth = 0;
+    };
+
+    struct match {
+        size_t start;
+        int32_t word;
+    };
+
+    std::vector<node> nodes = std::vector<node>(1);
+    int32_t n_words = 0;
+
+    int32_t state = 0;
+    size_t n_fed = 0;
+    std::vector<match> matches; // full matches since the last query
+
+    int32_t child(int32_t n, const T &c) const {
+        for (const auto &e : nodes[n].next) {
+            if (e.first == c) {
+                return e.second;
+            }
+        }
+        return -1;
+    }
+
+  public:
+    // add a word, the index of the words is the order they are added in
+    void add(const T *data, size_t n) {
+        const int32_t word = n_words++;
+        if (n == 0) {
+            return;
+        }
+        int32_t cur = 0;
+        for (size_t i = 0; i < n; i++) {
+            int32_t nxt = child(cur, data[i]);
+            if (nxt < 0) {
+                nxt = int32_t(nodes.size());
+                nodes.emplace_back();
+                nodes[nxt].depth = nodes[cur].depth + 1;
+                nodes[cur].next.emplace_back(data[i], nxt);
+            }
+            cur = nxt;
+        }
+        if (nodes[cur].word < 0) {
+            nodes[cur].word = word;
+        }
+    }
+
+    // compute the fail links once all the words are added
+    void build() {
+        std::vector<int32_t> queue;
+        for (const auto &e : nodes[0].next) {
+            nodes[e.second].fail = 0;
+            queue.push_back(e.second);
+        }
+        for (size_t i = 0; i < queue.size(); i++) {
+            const int32_t n = queue[i];
+            for (const auto &e : nodes[n].next) {
+                int32_t f = nodes[n].fail;
+                while (f != 0 && child(f, e.first) < 0) {
+                    f = nodes[f].fail;
+                }
+                const int32_t fc = child(f, e.first);
+                nodes[e.second].fail = fc >= 0 ? fc : 0;
+                const int32_t fl = nodes[e.second].fail;
+                nodes[e.second].out = nodes[fl].word >= 0 ? fl : nodes[fl].out;
+                queue.push_back(e.second);
+            }
+        }
+        reset();
+    }
+
+    // forget the words
+    void clear() {
+        nodes.assign(1, node());
+        n_words = 0;
+        reset();
+    }
+
+    // rewind the stream, keep the words
+    void reset() {
+        state = 0;
+        n_fed = 0;
+        matches.clear();
+    }
+
+    bool empty() const {
+        return nodes.size() == 1;
+    }
+
+    void feed(const T *data, size_t n) {
+        if (empty()) {
+            n_fed += n;
+            return;
+        }
+        for (size_t i = 0; i < n; i++) {
+            int32_t nxt;
+            while ((nxt = child(state, data[i])) < 0 && state != 0) {
+                state = nodes[state].fail;
+            }
+            state = nxt < 0 ? 0 : nxt;
+            n_fed++;
+
+            for (int32_t m = nodes[state].word >= 0 ? state : nodes[state].out; m >= 0;
+                 m = nodes[m].out) {
+                matches.push_back({n_fed - nodes[m].depth, nodes[m].word});
+            }
+        }
+    }
+
+    // the earliest full match fed since the last query that starts at or after from,
+    // returns its position relative to from or npos, and the index of the matched word
+    size_t full_match(size_t from, int32_t &word) {
+        size_t ret = std::string::npos;
+        for (const match &m : matches) {
+            if (m.start < from) {
+                continue;
+            }
+            if (ret == std::string::npos || m.start - from < ret ||
+                (m.start - from == ret && m.word < word)) {
+                ret = m.start - from;
+                word = m.word;
+            }
+        }
+        matches.clear();
+        return ret;
+    }
+
+    // the start of the longest tail of the stream that is a prefix of a word,
+    // not before from, returns its position relative to from or npos
+    size_t partial_match(size_t from) const {
+        if (from > n_fed) {
+            return std::string::npos;
+        }
+        int32_t n = state;
+        while (n != 0 && nodes[n].depth > n_fed - from) {
+            n = nodes[n].fail;
+        }
+        return n == 0 ? std::string::npos : n_fed - nodes[n].depth - from;
+    }
+};
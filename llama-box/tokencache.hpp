@@ -0,0 +1,145 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "llama.cpp/include/llama.h"
+
+#include "hash.hpp"
+
+// thread-safe LRU of token spans, bounded by the number of tokens it holds. a span is keyed by a
+// hash of the text it was tokenized from, the text is kept to rule out hash collisions, and
+// carries a tag for the owner.
+class token_lru {
+
+  private:
+    struct entry {
+        uint64_t key;
+        std::string text;
+        int32_t tag;
+        std::vector<llama_token> tokens;
+    };
+
+    size_t capacity = 0; // max tokens held, 0 = disabled
+    size_t size = 0;     // tokens held
+
+    std::mutex mutex;
+    std::list<entry> lru; // most recently used first
+    std::unordered_map<uint64_t, std::list<entry>::iterator> index;
+
+  public:
+    void init(size_t n_tokens) {
+        std::lock_guard<std::mutex> lock(mutex);
+        capacity = n_tokens;
+        size = 0;
+        lru.clear();
+        index.clear();
+    }
+
+    bool enabled() const {
+        return capacity > 0;
+    }
+
+    // the tag of the span of the key, 0 if not cached, the text is not checked
+    int32_t tag(uint64_t key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(key);
+        return it == index.end() ? 0 : it->second->tag;
+    }
+
+    // the tag of the span of the key and text, 0 if not cached
+    int32_t find(uint64_t key, const std::string &text) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(key);
+        return it == index.end() || it->second->text != text ? 0 : it->second->tag;
+    }
+
+    // append the tokens of the span of the key and text to out, returns false on a miss
+    bool get(uint64_t key, const std::string &text, std::vector<llama_token> &out) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(key);
+        if (it == index.end() || it->second->text != text) {
+            return false;
+        }
+        lru.splice(lru.begin(), lru, it->second);
+        out.insert(out.end(), it->second->tokens.begin(), it->second->tokens.end());
+        return true;
+    }
+
+    void put(uint64_t key, const std::string &text, int32_t tag,
+             const std::vector<llama_token> &tokens) {
+        if (tokens.size() > capacity) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (index.find(key) != index.end()) {
+            return;
+        }
+        lru.push_front({key, text, tag, tokens});
+        index[key] = lru.begin();
+        size += tokens.size();
+        while (size > capacity) {
+            size -= lru.back().tokens.size();
+            index.erase(lru.back().key);
+            lru.pop_back();
+        }
+    }
+
+    size_t n_tokens() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return size;
+    }
+};
+
+// cache of tokenized text segments, keyed by the text and the add_special flag.
+class token_cache {
+
+  private:
+    token_lru spans;
+    std::atomic<uint64_t> n_hit{0};
+    std::atomic<uint64_t> n_miss{0};
+
+    // FNV-1a over the text, mixed with the flag
+    static uint64_t hash(const std::string &text, bool add_special) {
+        return fnv1a(fnv1a(FNV1A_SEED, text.data(), text.size()), uint8_t(add_special ? 1 : 0));
+    }
+
+  public:
+    // segments shorter than this are cheaper to tokenize than to look up
+    static const size_t MIN_TEXT = 64;
+
+    void init(size_t n_tokens) {
+        spans.init(n_tokens);
+    }
+
+    bool enabled() const {
+        return spans.enabled();
+    }
+
+    // append the cached tokens of the text to out, returns false on a miss
+    bool get(const std::string &text, bool add_special, std::vector<llama_token> &out) {
+        if (!spans.get(hash(text, add_special), text, out)) {
+            n_miss++;
+            return false;
+        }
+        n_hit++;
+        return true;
+    }
+
+    void put(const std::string &text, bool add_special, const std::vector<llama_token> &tokens) {
+        spans.put(hash(text, add_special), text, 0, tokens);
+    }
+
+    // hits, misses and tokens held so far
+    void stats(uint64_t &hits, uint64_t &misses, size_t &n_tokens) {
+        hits = n_hit.load();
+        misses = n_miss.load();
+        n_tokens = spans.n_tokens();
+    }
+};
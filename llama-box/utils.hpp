@@ -10,6 +10,8 @@
 #include "llama.cpp/common/json.hpp"
 #include "llama.cpp/include/llama.h"
 
+#include "piecetable.hpp"
+
 #define DEFAULT_OAICOMPAT_MODEL "gpt-3.5-turbo-0613"
 
 using json = nlohmann::json;
@@ -21,8 +23,9 @@ enum error_type {
     ERROR_TYPE_SERVER,
     ERROR_TYPE_NOT_FOUND,
     ERROR_TYPE_PERMISSION,
-    ERROR_TYPE_UNAVAILABLE,   // custom error
-    ERROR_TYPE_NOT_SUPPORTED, // custom error
+    ERROR_TYPE_UNAVAILABLE,       // custom error
+    ERROR_TYPE_NOT_SUPPORTED,     // custom error
+    ERROR_TYPE_TOO_MANY_REQUESTS, // custom error
 };
 
 #define LOG_ERROR(MSG, ...) server_log("ERR", __func__, __LINE__, MSG, __VA_ARGS__)
@@ -100,34 +103,39 @@ static inline void server_log(const char *level, const char *function, int line,
 // chat template utils
 //
 
+// Parse a message of the chat, the text parts of an array content are joined
+inline llama_chat_msg parse_chat_msg(const json &curr_msg) {
+    std::string role = json_value(curr_msg, "role", std::string(""));
+
+    std::string content;
+    if (curr_msg.contains("content")) {
+        if (curr_msg["content"].is_string()) {
+            content = curr_msg["content"].get<std::string>();
+        } else if (curr_msg["content"].is_array()) {
+            for (const json &part : curr_msg["content"]) {
+                if (part.contains("text")) {
+                    content += "\n" + part["text"].get<std::string>();
+                }
+            }
+        } else {
+            throw std::runtime_error("Invalid 'content' type (ref: "
+                                     "https://github.com/ggerganov/llama.cpp/issues/8367)");
+        }
+    } else {
+        throw std::runtime_error(
+            "Missing 'content' (ref: https://github.com/ggerganov/llama.cpp/issues/8367)");
+    }
+
+    return {role, content};
+}
+
 // Format given chat. If tmpl is empty, we take the template from model metadata
 inline std::string format_chat(const struct llama_model *model, const std::string &tmpl,
                                const std::vector<json> &messages) {
     std::vector<llama_chat_msg> chat;
 
     for (const auto &curr_msg : messages) {
-        std::string role = json_value(curr_msg, "role", std::string(""));
-
-        std::string content;
-        if (curr_msg.contains("content")) {
-            if (curr_msg["content"].is_string()) {
-                content = curr_msg["content"].get<std::string>();
-            } else if (curr_msg["content"].is_array()) {
-                for (const json &part : curr_msg["content"]) {
-                    if (part.contains("text")) {
-                        content += "\n" + part["text"].get<std::string>();
-                    }
-                }
-            } else {
-                throw std::runtime_error("Invalid 'content' type (ref: "
-                                         "https://github.com/ggerganov/llama.cpp/issues/8367)");
-            }
-        } else {
-            throw std::runtime_error(
-                "Missing 'content' (ref: https://github.com/ggerganov/llama.cpp/issues/8367)");
-        }
-
-        chat.push_back({role, content});
+        chat.push_back(parse_chat_msg(curr_msg));
     }
 
     return llama_chat_apply_template(model, tmpl, chat, true);
@@ -251,44 +259,6 @@ static size_t common_part(const std::string &a, const std::string &b) {
     return i;
 }
 
-static bool ends_with(const std::string &str, const std::string &suffix) {
-    return str.size() >= suffix.size() &&
-           0 == str.compare(str.size() - suffix.size(), suffix.size(), suffix);
-}
-
-static size_t find_partial_stop_string(const std::string &stop, const std::string &text) {
-    if (!text.empty() && !stop.empty()) {
-        const char text_last_char = text.back();
-        for (int64_t char_index = stop.size() - 1; char_index >= 0; char_index--) {
-            if (stop[char_index] == text_last_char) {
-                const std::string current_partial = stop.substr(0, char_index + 1);
-                if (ends_with(text, current_partial)) {
-                    return text.size() - char_index - 1;
-                }
-            }
-        }
-    }
-
-    return std::string::npos;
-}
-
-// format incomplete utf-8 multibyte character for output
-static std::string tokens_to_output_formatted_string(const llama_context *ctx,
-                                                     const llama_token token) {
-    std::string out = token == -1 ? "" : llama_token_to_piece(ctx, token);
-
-    // if the size is 1 and first bit is 1, meaning it's a partial character
-    //   (size > 1 meaning it's already a known token)
-    if (out.size() == 1 && (out[0] & 0x80) == 0x80) {
-        std::stringstream ss;
-        ss << std::hex << (out[0] & 0xff);
-        std::string res(ss.str());
-        out = "byte: \\x" + res;
-    }
-
-    return out;
-}
-
 struct completion_token_output {
     std::vector<llama_token> toks;
     std::string text_to_send;
@@ -302,7 +272,7 @@ struct completion_token_output {
 };
 
 // convert a vector of completion_token_output to json
-static json probs_vector_to_json(const llama_context *ctx,
+static json probs_vector_to_json(const piece_table &pieces,
                                  const std::vector<completion_token_output> &probs,
                                  const bool oaicompat_completion = false,
                                  const bool oaicompat_completion_chat = false) {
@@ -313,12 +283,12 @@ static json probs_vector_to_json(const llama_context *ctx,
             for (const auto &prob : probs) {
                 const auto sz_toks = int32_t(prob.toks.size());
                 for (int32_t i = 0; i < sz_toks; i++) {
-                    const std::string token = tokens_to_output_formatted_string(ctx, prob.toks[i]);
+                    const std::string token = pieces.escaped(prob.toks[i]);
                     float token_logprob = 1.0f;
                     std::vector<unsigned char> token_bytes(token.begin(), token.end());
                     json token_top_logprobs = json::array();
                     for (const auto &p : prob.probss[i]) {
-                        const std::string p_token = tokens_to_output_formatted_string(ctx, p.tok);
+                        const std::string p_token = pieces.escaped(p.tok);
                         float p_token_logprob = p.prob;
                         std::vector<unsigned char> p_token_bytes(p_token.begin(), p_token.end());
                         token_top_logprobs.push_back(json{
@@ -349,11 +319,11 @@ static json probs_vector_to_json(const llama_context *ctx,
             for (const auto &prob : probs) {
                 const auto sz_toks = int32_t(prob.toks.size());
                 for (int32_t i = 0; i < sz_toks; i++) {
-                    const std::string token = tokens_to_output_formatted_string(ctx, prob.toks[i]);
+                    const std::string token = pieces.escaped(prob.toks[i]);
                     float token_logprob = 1.0f;
                     json token_top_logprobs;
                     for (const auto &p : prob.probss[i]) {
-                        const std::string p_token = tokens_to_output_formatted_string(ctx, p.tok);
+                        const std::string p_token = pieces.escaped(p.tok);
                         float p_token_logprob = p.prob;
                         token_top_logprobs[p_token] = p_token_logprob;
                         if (p.tok == prob.toks[i]) {
@@ -380,14 +350,14 @@ static json probs_vector_to_json(const llama_context *ctx,
         for (int32_t i = 0; i < sz_toks; i++) {
             json probs_for_token = json::array();
             for (const auto &p : prob.probss[i]) {
-                const std::string tok_str = tokens_to_output_formatted_string(ctx, p.tok);
+                const std::string tok_str = pieces.escaped(p.tok);
                 probs_for_token.push_back(json{
                     {"tok_str", tok_str},
                     {"prob", p.prob},
                 });
             }
 
-            const std::string tok_str = tokens_to_output_formatted_string(ctx, prob.toks[i]);
+            const std::string tok_str = pieces.escaped(prob.toks[i]);
             out.push_back(json{
                 {"content", tok_str},
                 {"probs", probs_for_token},
@@ -402,8 +372,10 @@ static json probs_vector_to_json(const llama_context *ctx,
 // OAI utils
 //
 
+// If prompt is given, it is the already rendered chat, e.g. the token ids of the messages
 static json oaicompat_completion_request(const struct llama_model *model, const json &body,
-                                         const std::string &chat_template) {
+                                         const std::string &chat_template,
+                                         const json &prompt = json()) {
     // Print the request for debugging
     {
         json body_cp = body;
@@ -448,7 +420,9 @@ static json oaicompat_completion_request(const struct llama_model *model, const
                 }
             }
         }
-        if (!chat_vision) {
+        if (!chat_vision && !prompt.is_null()) {
+            llama_params["prompt"] = prompt;
+        } else if (!chat_vision) {
             llama_params["prompt"] = format_chat(model, chat_template, messages);
         } else {
             llama_params["__oaicompat_completion_chat_vision"] = true;
@@ -725,6 +699,10 @@ static json format_error_response(const std::string &message, const enum error_t
         type_str = "unavailable_error";
         code = 503;
         break;
+    case ERROR_TYPE_TOO_MANY_REQUESTS:
+        type_str = "too_many_requests_error";
+        code = 429;
+        break;
     }
     return json{
         {"code", code},